@@ -6,17 +6,64 @@
 #include <string.h>
 #include <math.h>
 #include "knn.h"
+#include "kernels.h"
 
 /**
  * main() takes in the following command line arguments.
  *   -K <num>:  K value for kNN (default is 1)
  *   -d <distance metric>: a string for the distance function to use
- *          euclidean or cosine (or initial substring such as "eucl", or "cos")
+ *          euclidean, cosine or manhattan (or initial substring such as "eucl",
+ *          "cos" or "man")
  *   -p <num_procs>: The number of processes to use to test images
+ *   -t : Also keep a pixel-major copy of the training set, which the
+ *        euclidean distance scans a block of images at a time
+ *   -m <mult>: Shortlist the K * mult training images nearest in Hamming
+ *        distance on binarized images, and only rank those with the distance
+ *        metric. Faster but approximate; 0 (the default) searches exactly
+ *   -c <num>: Shortlist by euclidean distance between projections onto the
+ *        first <num> principal components (32 to 64 work well) instead of by
+ *        Hamming distance, with mult from -m or DEFAULT_SHORTLIST. The fitted
+ *        projection is saved next to the training file, with a ".pca"
+ *        suffix, and reused by later runs on the same training data
+ *   -n : Visit training images outward from the query's norm and stop once
+ *        the norm gap rules out the rest. Exact, and faster when image norms
+ *        vary much more than the distances between neighbors
+ *   -P <num>: Keep the euclidean distances of every training image to <num>
+ *        spread out pivot images, and skip images that the triangle
+ *        inequality over them rules out. Exact
+ *   -V : Search a vantage-point tree over the training images, which skips
+ *        whole subtrees the triangle inequality rules out. Exact, and only
+ *        for the euclidean and manhattan distances, without -m, -c, -H, -I
+ *        or an index holding a graph. The tree is saved next to the
+ *        training file, with a ".vpt" suffix, and reused by later runs on the
+ *        same training data. It is first checked against a search of every
+ *        image for up to CHECKED_TESTS test images, and any difference is an
+ *        error
+ *   -H <M>: Walk a navigable small world graph (HNSW) linking every training
+ *        image to about <M> nearby ones (8 to 32 work well) towards each
+ *        test image, and only rank the images it meets with the distance
+ *        metric. Much faster on large training sets but approximate. The
+ *        graph is saved next to the training file, with a ".hnsw" suffix,
+ *        and later runs on the same training data map it instead
+ *   -e <ef>: Images the graph search of -H keeps, at least K. Larger values
+ *        miss fewer neighbors (default is DEFAULT_EF)
+ *   -I <cells>: Split the training images into <cells> k-means cells (the
+ *        square root of the training set size works well) and keep each as
+ *        a 4-bit product-quantized code of its offset from its cell's center
+ *        (IVF-PQ). The codes of the cells nearest to each test image are
+ *        scanned for the K * mult nearest, with mult from -m or
+ *        DEFAULT_SHORTLIST, and only those are ranked with the distance
+ *        metric. Much faster but approximate
+ *   -N <nprobe>: Cells -I scans per test image. More miss fewer neighbors
+ *        (default is DEFAULT_NPROBE)
  *   -v : If this argument is provided, then print additional debugging information
  *        (You are welcome to add print statements that only print with the verbose
  *         option.  We will not be running tests with -v )
- *   training_data: A binary file containing training image / label data
+ *   training_data: A binary file containing training image / label data, or
+ *        an index of one written by knn_index, which is mapped and searched
+ *        as it is, with the pivot table, graph, vantage-point tree,
+ *        projection or inverted file it holds, if any. -P, -H, -c and -I
+ *        then reuse those, and asking for other sizes is an error
  *   testing_data: A binary file containing testing image / label data
  *   (Note that the first three "option" arguments (-K <num>, -d <distance metric>,
  *   and -p <num_procs>) may appear in any order, but the two dataset files must
@@ -39,8 +86,24 @@
  *   - Free all the data allocated and exit.
  *   - Handle all relevant errors, exiting as appropriate and printing error message to stderr
  */
+/* Shortlist multiplier of -c when -m is not given */
+#define DEFAULT_SHORTLIST 10
+
+/* Images the graph search keeps when -e is not given */
+#define DEFAULT_EF 64
+
+/* Cells the inverted file search of -I scans when -N is not given */
+#define DEFAULT_NPROBE 8
+
+/* Test images whose neighbors are checked when -V is given */
+#define CHECKED_TESTS 100
+
+/* The metrics -d can select, matched by name in this order */
+static const Metric *metrics[] = {&metric_euclidean, &metric_cosine, &metric_manhattan};
+#define NUM_METRICS (int)(sizeof(metrics) / sizeof(metrics[0]))
+
 void usage(char *name) {
-    fprintf(stderr, "Usage: %s -v -K <num> -d <distance metric> -p <num_procs> training_list testing_list\n", name);
+    fprintf(stderr, "Usage: %s -v -K <num> -d <distance metric> -p <num_procs> -t -m <mult> -c <num> -n -P <num> -V -H <M> -e <ef> -I <cells> -N <nprobe> training_list testing_list\n", name);
 }
 
 int main(int argc, char *argv[]) {
@@ -50,9 +113,19 @@ int main(int argc, char *argv[]) {
     char *dist_metric = "euclidean"; // default distant metric
     int num_procs = 1;     // default number of children to create
     int verbose = 0;       // if verbose is 1, print extra debugging statements
+    int transpose = 0;     // if transpose is 1, add a pixel-major training copy
+    int shortlist = 0;     // Hamming shortlist multiplier, 0 for exact search
+    int components = 0;    // PCA components of the shortlist, 0 for none
+    int by_norm = 0;       // if by_norm is 1, search images by norm
+    int pivots = 0;        // Pivots of the pivot table, 0 for none
+    int vp_tree = 0;       // if vp_tree is 1, search a vantage-point tree
+    int graph_links = 0;   // M of the navigable graph, 0 for none
+    int ef = DEFAULT_EF;   // Images the graph search keeps
+    int cells = 0;         // k-means cells of the inverted file, 0 for none
+    int nprobe = DEFAULT_NPROBE; // Cells the inverted file search scans
     int total_correct = 0; // Number of correct predictions
 
-    while((opt = getopt(argc, argv, "vK:d:p:")) != -1) {
+    while((opt = getopt(argc, argv, "vK:d:p:tm:c:nP:VH:e:I:N:")) != -1) {
         switch(opt) {
         case 'v':
             verbose = 1;
@@ -66,6 +139,36 @@ int main(int argc, char *argv[]) {
         case 'p':
             num_procs = atoi(optarg);
             break;
+        case 't':
+            transpose = 1;
+            break;
+        case 'm':
+            shortlist = atoi(optarg);
+            break;
+        case 'c':
+            components = atoi(optarg);
+            break;
+        case 'n':
+            by_norm = 1;
+            break;
+        case 'P':
+            pivots = atoi(optarg);
+            break;
+        case 'V':
+            vp_tree = 1;
+            break;
+        case 'H':
+            graph_links = atoi(optarg);
+            break;
+        case 'e':
+            ef = atoi(optarg);
+            break;
+        case 'I':
+            cells = atoi(optarg);
+            break;
+        case 'N':
+            nprobe = atoi(optarg);
+            break;
         default:
             usage(argv[0]);
             exit(1);
@@ -92,19 +195,35 @@ int main(int argc, char *argv[]) {
      */ 
   
     // TODO
-    double (*metric)(Image *a, Image *b);
-    if (strncmp(dist_metric, "euclidean", strlen(dist_metric)) == 0) {
-        metric = distance_euclidean;
-    } else if (strncmp(dist_metric, "cosine", strlen(dist_metric)) == 0) {
-        metric = distance_cosine;
-    } else {
-        fprintf(stderr, "Expected any initial substring of \"euclidean\" or \"cosine\" as argument for -d\n");
-        exit(1);        
+    const Metric *metric = NULL;
+    for (int i = 0; i < NUM_METRICS; i++) {
+        if (strncmp(dist_metric, metrics[i]->name, strlen(dist_metric)) == 0) {
+            metric = metrics[i];
+            break;
+        }
+    }
+    if (metric == NULL) {
+        fprintf(stderr, "Expected any initial substring of");
+        for (int i = 0; i < NUM_METRICS; i++) {
+            fprintf(stderr, "%s \"%s\"", i == 0 ? "" : i == NUM_METRICS - 1 ? " or" : ",",
+                    metrics[i]->name);
+        }
+        fprintf(stderr, " as argument for -d\n");
+        exit(1);
+    }
+    // The approximate searches take precedence over the vantage-point tree,
+    // and cosine never uses it, so its check would compare nothing
+    if (vp_tree && (metric->norm_bound == NULL || shortlist > 0 || components > 0 ||
+                    graph_links > 0 || cells > 0)) {
+        fprintf(stderr, "-V takes the euclidean or manhattan distance, without -m, -c, -H or -I\n");
+        usage(argv[0]);
+        exit(1);
     }
 
 
     // Load data sets
     if(verbose) {
+        fprintf(stderr,"- Using %s distance kernels\n", kernels.name);
         fprintf(stderr,"- Loading datasets...\n");
     }
     
@@ -113,12 +232,120 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "The data set in %s could not be loaded\n", training_file);
         exit(1);
     }
+    if (vp_tree && (training->hnsw != NULL || training->ivf != NULL ||
+                    training->projected != NULL)) {
+        fprintf(stderr, "-V cannot be used with %s, whose graph or shortlist is searched instead\n",
+                training_file);
+        exit(1);
+    }
+    prepare_training(training, metric);
+    if (verbose) {
+        fprintf(stderr, "- Training images are %dx%d, using %s kernels\n", training->sx,
+                training->sy, training->kernels->pixels != 0 ? "size specialized" : "generic");
+    }
+    if (verbose && training->sparse_start != NULL) {
+        fprintf(stderr, "- Listing the nonzero pixels of the training images (%.0f%% of them)\n",
+                training->density * 100);
+    }
+    if (transpose) {
+        transpose_training(training);
+    }
+    if (pivots > 0) {
+        if (verbose && training->pivots != NULL) {
+            fprintf(stderr, "- Using the %d pivots of the index\n", training->num_pivots);
+        } else if (verbose) {
+            fprintf(stderr, "- Measuring distances to %d pivots\n", pivots);
+        }
+        pivot_training(training, pivots);
+    }
+    if (vp_tree) {
+        if (verbose && training->vp_tree != NULL) {
+            fprintf(stderr, "- Using the vantage-point tree of the index\n");
+        } else if (verbose) {
+            fprintf(stderr, "- Building or loading the vantage-point tree\n");
+        }
+        char cache_file[strlen(training_file) + sizeof(".vpt")];
+        sprintf(cache_file, "%s.vpt", training_file);
+        vp_tree_training(training, cache_file);
+    }
+    if (graph_links > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Searching a graph with M = %d, keeping %d images\n",
+                    graph_links, ef);
+        }
+        if (verbose && training->hnsw != NULL) {
+            fprintf(stderr, "- Using the graph of the index\n");
+        }
+        char cache_file[strlen(training_file) + sizeof(".hnsw")];
+        sprintf(cache_file, "%s.hnsw", training_file);
+        hnsw_training(training, graph_links, ef, cache_file);
+    }
+    if (by_norm) {
+        order_training_by_norm(training);
+    }
+    if (components > 0) {
+        if (shortlist == 0) {
+            shortlist = DEFAULT_SHORTLIST;
+        }
+        if (verbose) {
+            fprintf(stderr, "- Shortlisting %d * K images by distance over %d principal components\n",
+                    shortlist, components);
+        }
+        if (verbose && training->projected != NULL) {
+            fprintf(stderr, "- Using the projection of the index\n");
+        }
+        char cache_file[strlen(training_file) + sizeof(".pca")];
+        sprintf(cache_file, "%s.pca", training_file);
+        project_training(training, components, shortlist, cache_file);
+    } else if (cells > 0) {
+        if (shortlist == 0) {
+            shortlist = DEFAULT_SHORTLIST;
+        }
+        if (verbose) {
+            fprintf(stderr, "- Shortlisting %d * K images from %d of %d cells by their codes\n",
+                    shortlist, nprobe, cells);
+        }
+        if (verbose && training->ivf != NULL) {
+            fprintf(stderr, "- Using the inverted file of the index\n");
+        }
+        ivf_training(training, cells, nprobe, shortlist);
+        if (verbose && training->ivf != NULL) {
+            fprintf(stderr, "- Codes take %.1f MB\n",
+                    (double)ivf_code_bytes(training) / (1 << 20));
+        }
+    } else if (shortlist > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Shortlisting %d * K images by Hamming distance\n", shortlist);
+        }
+        binarize_training(training, shortlist);
+    }
 
-    Dataset *testing = load_dataset(testing_file);
-    if ( testing == NULL ) {
+    // Only the size of the test set is needed here; every child maps just
+    // the slice of it that it has been assigned.
+    int num_tests = dataset_size(testing_file);
+    if ( num_tests == -1 ) {
         fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
         exit(1);
     }
+    if (vp_tree) {
+        int checked = num_tests < CHECKED_TESTS ? num_tests : CHECKED_TESTS;
+        Dataset *testing = map_dataset_slice(testing_file, 0, checked);
+        if (testing == NULL) {
+            fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
+            exit(1);
+        }
+        int mismatches = vp_tree_mismatches(training, testing, K, metric);
+        if (mismatches > 0) {
+            fprintf(stderr, "Error: the vantage-point tree missed neighbors of %d of %d test images\n",
+                    mismatches, checked);
+            exit(1);
+        }
+        if (verbose) {
+            fprintf(stderr, "- The vantage-point tree agrees with a full search on %d test images\n",
+                    checked);
+        }
+        free_dataset(testing);
+    }
 
     // Create the pipes and child processes who will then call child_handler.
     // Distribute the work to the children by writing their starting index and
@@ -131,15 +358,15 @@ int main(int argc, char *argv[]) {
     int from_children[num_procs * 2];
 
     int start_idx = 0;
-    int boundary = testing->num_items % num_procs;
+    int boundary = num_tests % num_procs;
     int N;
 
     for (int i = 0; i < num_procs; i++) {
 
         if (i < boundary) {
-            N = ceil( (double)testing->num_items / num_procs);
+            N = ceil( (double)num_tests / num_procs);
         } else {
-            N = floor( (double)testing->num_items / num_procs);
+            N = floor( (double)num_tests / num_procs);
         }
 
         int *c_to_p = from_children + 2*i;
@@ -179,7 +406,7 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
 
-            child_handler(training, testing, K, metric, p_to_c[0], c_to_p[1]);
+            child_handler(training, testing_file, K, metric, p_to_c[0], c_to_p[1]);
 
             // Close all unnecessary pipe ends
 
@@ -192,9 +419,8 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
 
-            // Free datasets since their instance is also created for each child
+            // Free the training set since its instance is also created for each child
             free_dataset(training);
-            free_dataset(testing);
 
             // Child should stop here
             exit(0);
@@ -235,6 +461,10 @@ int main(int argc, char *argv[]) {
             } else if (num_read == -1) {
                 perror("read");
                 exit(1);
+            } else if (num_read == 0) {
+                // The child exited without sending its result
+                fprintf(stderr, "A child process failed to classify its images\n");
+                exit(1);
             }
         }
 
@@ -279,7 +509,6 @@ int main(int argc, char *argv[]) {
 
     // TODO
     free_dataset(training);
-    free_dataset(testing);
 
     return 0;
 }
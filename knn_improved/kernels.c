@@ -0,0 +1,1286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+
+/*
+ * The bounded kernels compare the running sum against the bound once per
+ * block of this many pixels. It is a multiple of every vector width below,
+ * so each block runs entirely in vector code.
+ */
+#define ABANDON_BLOCK 128
+
+/*
+ * The 16-bit kernels add squares of block sum differences in 32-bit lanes,
+ * and move them into a 64-bit total every this many entries, well before
+ * the lanes could overflow.
+ */
+#define FLUSH_BLOCK 128
+
+/*
+ * Marks the main loop of every kernel. Loops with a known trip count of up
+ * to 16 are unrolled completely, longer ones 16 times.
+ */
+#define UNROLL _Pragma("GCC unroll 16")
+
+/**
+ * Every instruction set below provides always-inlined `sq_diff_<isa>`,
+ * `sad_<isa>`, `dot_<isa>`, `dot_4x4_<isa>`, `sq_diff_columns_<isa>`,
+ * `hamming_<isa>`, `sq_diff_u16_<isa>`, `sad_u16_<isa>`, `sq_diff_f32_<isa>`,
+ * `max_diff_f32_<isa>`, `dot_sparse_<isa>`, `dot_sparse_block_<isa>` and
+ * `pq_scan_<isa>` bodies, and the SPARSE_DENSITY_<isa> and
+ * SPARSE_BLOCK_DENSITY_<isa> they reach.
+ * KERNEL_ENTRIES wraps them into the functions that
+ * go in the kernel table, compiled with the given target attribute, and
+ * BOUNDED_ENTRY builds the early-abandoning variants of sq_diff and sad
+ * from blocks of the inlined body.
+ *
+ * The entries named `<kernel>_<isa>_<suffix>` work on images of `size`
+ * pixels. With `size` set to the runtime `n` they take any size; with a
+ * constant, every loop has a known trip count, so the compiler unrolls it
+ * and resolves the tails at compile time. The 16-bit, float, sparse and PQ
+ * kernels do not work on whole images, so UNSIZED_ENTRIES only builds them
+ * for any size.
+ */
+#define BOUNDED_ENTRY(kernel, isa, target, suffix, size)                         \
+    target static unsigned int kernel##_bounded_##isa##_##suffix(                \
+            const unsigned char *a, const unsigned char *b, int n,               \
+            unsigned int bound) {                                                \
+        unsigned int d = 0;                                                      \
+        UNROLL                                                                   \
+        for (int i = 0; i < (size) && d <= bound; i += ABANDON_BLOCK) {          \
+            d += kernel##_##isa(a + i, b + i, (size) - i < ABANDON_BLOCK ?       \
+                                              (size) - i : ABANDON_BLOCK);       \
+        }                                                                        \
+        return d;                                                                \
+    }
+
+#define KERNEL_ENTRIES(isa, target, suffix, size)                                \
+    target static unsigned int sq_diff_##isa##_##suffix(const unsigned char *a,  \
+                                                        const unsigned char *b,  \
+                                                        int n) {                 \
+        return sq_diff_##isa(a, b, size);                                        \
+    }                                                                            \
+    target static unsigned int dot_##isa##_##suffix(const unsigned char *a,      \
+                                                    const unsigned char *b,      \
+                                                    int n) {                     \
+        return dot_##isa(a, b, size);                                            \
+    }                                                                            \
+    BOUNDED_ENTRY(sq_diff, isa, target, suffix, size)                           \
+    target static unsigned int sad_##isa##_##suffix(const unsigned char *a,      \
+                                                    const unsigned char *b,      \
+                                                    int n) {                     \
+        return sad_##isa(a, b, size);                                            \
+    }                                                                            \
+    BOUNDED_ENTRY(sad, isa, target, suffix, size)                                \
+    target static void dot_4x4_##isa##_##suffix(const short *const q[4],         \
+                                                const unsigned char *const t[4], \
+                                                int n, unsigned int out[16]) {   \
+        dot_4x4_##isa(q, t, size, out);                                          \
+    }                                                                            \
+    target static void sq_diff_columns_##isa##_##suffix(                         \
+            const unsigned char *block, const unsigned char *q, int n,           \
+            unsigned int bound, unsigned int out[COLUMN_BLOCK]) {                \
+        sq_diff_columns_##isa(block, q, size, bound, out);                       \
+    }                                                                            \
+    target static unsigned int hamming_##isa##_##suffix(                         \
+            const unsigned long long *a, const unsigned long long *b, int n) {   \
+        return hamming_##isa(a, b, size);                                        \
+    }
+
+#define UNSIZED_ENTRIES(isa, target)                                             \
+    target static unsigned long long sq_diff_u16_##isa##_any(                    \
+            const unsigned short *a, const unsigned short *b, int n) {           \
+        return sq_diff_u16_##isa(a, b, n);                                       \
+    }                                                                            \
+    target static unsigned int sad_u16_##isa##_any(                              \
+            const unsigned short *a, const unsigned short *b, int n) {           \
+        return sad_u16_##isa(a, b, n);                                           \
+    }                                                                            \
+    target static float sq_diff_f32_##isa##_any(const float *a, const float *b,  \
+                                                int n) {                         \
+        return sq_diff_f32_##isa(a, b, n);                                       \
+    }                                                                            \
+    target static float max_diff_f32_##isa##_any(const float *a, const float *b, \
+                                                 int n) {                        \
+        return max_diff_f32_##isa(a, b, n);                                      \
+    }                                                                            \
+    target static unsigned int dot_sparse_##isa##_any(                           \
+            const unsigned short *index, const unsigned char *values, int nnz,   \
+            const unsigned char *dense) {                                        \
+        return dot_sparse_##isa(index, values, nnz, dense);                      \
+    }                                                                            \
+    target static void dot_sparse_block_##isa##_any(                             \
+            const unsigned short *index, const unsigned char *values, int nnz,   \
+            const short *block, unsigned int out[SPARSE_QUERIES]) {              \
+        dot_sparse_block_##isa(index, values, nnz, block, out);                  \
+    }                                                                            \
+    target static void pq_scan_##isa##_any(const unsigned char *codes,           \
+                                           const unsigned char *luts,            \
+                                           int subspaces,                        \
+                                           unsigned short out[PQ_BLOCK]) {       \
+        pq_scan_##isa(codes, luts, subspaces, out);                              \
+    }
+
+/*
+ * The image sizes with specialized kernels: 28x28, 32x32, 64x64 and 96x96.
+ * X(a, b, pixels) is expanded once for each of them.
+ */
+#define FOR_EACH_GEOMETRY(X, a, b) X(a, b, 784) X(a, b, 1024) X(a, b, 4096) X(a, b, 9216)
+#define NUM_GEOMETRIES 4
+
+/* The generic entries and one set of specialized entries per image size */
+#define SIZED_ENTRIES(isa, target, pixels) KERNEL_ENTRIES(isa, target, pixels, pixels)
+#define ALL_ENTRIES(isa, target)                                                 \
+    KERNEL_ENTRIES(isa, target, any, n)                                          \
+    UNSIZED_ENTRIES(isa, target)                                                 \
+    FOR_EACH_GEOMETRY(SIZED_ENTRIES, isa, target)
+
+#define KERNEL_SET(name, isa, suffix, pixels)                                    \
+    {name, pixels, sq_diff_##isa##_##suffix, dot_##isa##_##suffix,               \
+     sq_diff_bounded_##isa##_##suffix, sad_##isa##_##suffix,                     \
+     sad_bounded_##isa##_##suffix, dot_4x4_##isa##_##suffix,                     \
+     sq_diff_columns_##isa##_##suffix, hamming_##isa##_##suffix,                 \
+     sq_diff_u16_##isa##_any, sad_u16_##isa##_any, sq_diff_f32_##isa##_any,     \
+     max_diff_f32_##isa##_any, dot_sparse_##isa##_any,                           \
+     dot_sparse_block_##isa##_any, pq_scan_##isa##_any, SPARSE_DENSITY_##isa,    \
+     SPARSE_BLOCK_DENSITY_##isa}
+#define SIZED_SET(name, isa, pixels) , KERNEL_SET(name, isa, pixels, pixels)
+#define ALL_SETS(name, isa)                                                      \
+    {KERNEL_SET(name, isa, any, 0) FOR_EACH_GEOMETRY(SIZED_SET, name, isa)}
+
+/****************************************************************************/
+/* Portable scalar kernels, used when no vector extension is available.     */
+/****************************************************************************/
+
+static inline unsigned int sq_diff_scalar(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        int diff = a[i] - b[i];
+        d += diff * diff;
+    }
+    return d;
+}
+
+static inline unsigned int sad_scalar(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return d;
+}
+
+static inline unsigned int dot_scalar(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += a[i] * b[i];
+    }
+    return d;
+}
+
+/* Bit arrays are padded to whole 64-bit words, so no tail is needed */
+static inline unsigned int hamming_scalar(const unsigned long long *a,
+                                          const unsigned long long *b, int n) {
+    unsigned int d = 0;
+    UNROLL
+    for (int i = 0; i < (n + 63) / 64; i++) {
+        d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return d;
+}
+
+static inline unsigned long long sq_diff_u16_scalar(const unsigned short *a,
+                                                    const unsigned short *b, int n) {
+    unsigned long long d = 0;
+    for (int i = 0; i < n; i++) {
+        int diff = a[i] - b[i];
+        d += diff * diff;
+    }
+    return d;
+}
+
+static inline unsigned int sad_u16_scalar(const unsigned short *a, const unsigned short *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return d;
+}
+
+static inline float sq_diff_f32_scalar(const float *a, const float *b, int n) {
+    float d = 0;
+    for (int i = 0; i < n; i++) {
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return d;
+}
+
+static inline float max_diff_f32_scalar(const float *a, const float *b, int n) {
+    float m = 0;
+    for (int i = 0; i < n; i++) {
+        float d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        m = d > m ? d : m;
+    }
+    return m;
+}
+
+static inline unsigned int dot_sparse_scalar(const unsigned short *index,
+                                             const unsigned char *values, int nnz,
+                                             const unsigned char *dense) {
+    unsigned int d = 0;
+    for (int i = 0; i < nnz; i++) {
+        d += values[i] * dense[index[i]];
+    }
+    return d;
+}
+
+static inline void dot_sparse_block_scalar(const unsigned short *index,
+                                           const unsigned char *values, int nnz,
+                                           const short *block,
+                                           unsigned int out[SPARSE_QUERIES]) {
+    for (int q = 0; q < SPARSE_QUERIES; q++) {
+        out[q] = 0;
+    }
+    for (int i = 0; i < nnz; i++) {
+        const short *row = block + (size_t)index[i] * SPARSE_QUERIES;
+        for (int q = 0; q < SPARSE_QUERIES; q++) {
+            out[q] += values[i] * row[q];
+        }
+    }
+}
+
+static inline void pq_scan_scalar(const unsigned char *codes, const unsigned char *luts,
+                                  int subspaces, unsigned short out[PQ_BLOCK]) {
+    for (int j = 0; j < PQ_BLOCK; j++) {
+        out[j] = 0;
+    }
+    for (int s = 0; s < subspaces; s++) {
+        const unsigned char *row = codes + 16 * s;
+        const unsigned char *lut = luts + 16 * s;
+        for (int j = 0; j < 16; j++) {
+            out[j] += lut[row[j] & 0x0f];
+            out[j + 16] += lut[row[j] >> 4];
+        }
+    }
+}
+
+/*
+ * Below these fractions of nonzero pixels, measured on 28x28 digits, the
+ * sparse dot products beat the dense ones of the same instruction set:
+ * dot_sparse against dot, and dot_sparse_block against dot_4x4
+ */
+#define SPARSE_DENSITY_scalar 0.5f
+#define SPARSE_DENSITY_sse41 0.15f
+#define SPARSE_DENSITY_avx2 0.2f
+#define SPARSE_DENSITY_avx512 0.15f
+#define SPARSE_BLOCK_DENSITY_scalar 0.1f
+#define SPARSE_BLOCK_DENSITY_sse41 0.4f
+#define SPARSE_BLOCK_DENSITY_avx2 0.4f
+#define SPARSE_BLOCK_DENSITY_avx512 0.4f
+
+/* Tile tail shared by every instruction set: pixels `from` to `n` */
+static inline void dot_4x4_tail(const short *const q[4], const unsigned char *const t[4],
+                                int from, int n, unsigned int out[16]) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            unsigned int d = 0;
+            for (int p = from; p < n; p++) {
+                d += q[i][p] * t[j][p];
+            }
+            out[4 * i + j] += d;
+        }
+    }
+}
+
+static inline void dot_4x4_scalar(const short *const q[4], const unsigned char *const t[4],
+                           int n, unsigned int out[16]) {
+    memset(out, 0, sizeof(unsigned int) * 16);
+    dot_4x4_tail(q, t, 0, n, out);
+}
+
+static inline void sq_diff_columns_scalar(const unsigned char *block, const unsigned char *q,
+                                   int n, unsigned int bound, unsigned int out[COLUMN_BLOCK]) {
+    memset(out, 0, sizeof(unsigned int) * COLUMN_BLOCK);
+    UNROLL
+    for (int p = 0; p < n; p += ABANDON_BLOCK) {
+        int end = n - p < ABANDON_BLOCK ? n : p + ABANDON_BLOCK;
+        for (int r = p; r < end; r++) {
+            const unsigned char *row = block + (size_t)r * COLUMN_BLOCK;
+            for (int j = 0; j < COLUMN_BLOCK; j++) {
+                int diff = row[j] - q[r];
+                out[j] += diff * diff;
+            }
+        }
+        unsigned int least = out[0];
+        for (int j = 1; j < COLUMN_BLOCK; j++) {
+            least = out[j] < least ? out[j] : least;
+        }
+        if (least > bound) {
+            return;
+        }
+    }
+}
+
+/*
+ * The vector column kernels square pairs of rows with pmaddwd, after
+ * interleaving them with unpack instructions that work within 128-bit
+ * lanes. Accumulator c of a group of 16 * `lanes` images then holds, in
+ * dword 4 * L + m, image 16 * L + 4 * c + m of the group. This puts the
+ * sums back in image order.
+ */
+static void unscramble_columns(const unsigned int *acc, int lanes, unsigned int out[COLUMN_BLOCK]) {
+    for (int g = 0; g < COLUMN_BLOCK; g += 16 * lanes) {
+        for (int c = 0; c < 4; c++) {
+            for (int L = 0; L < lanes; L++) {
+                for (int m = 0; m < 4; m++) {
+                    out[g + 16 * L + 4 * c + m] = acc[g + 4 * lanes * c + 4 * L + m];
+                }
+            }
+        }
+    }
+}
+
+ALL_ENTRIES(scalar, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/****************************************************************************/
+/* x86 kernels. Each function is compiled for its own instruction set with  */
+/* the target attribute, so one binary carries all of them and only calls  */
+/* the ones the CPU supports.                                               */
+/*                                                                          */
+/* Pixels are widened to 16 bits and multiplied with pmaddwd, which adds    */
+/* adjacent products into 32-bit lanes. For euclidean, |a - b| is formed    */
+/* in 8 bits first with two saturating subtractions, so only one operand    */
+/* needs widening.                                                          */
+/*                                                                          */
+/* The SSE4.1 kernels are also inlined into the AVX2 ones for their tails,  */
+/* so legacy SSE and VEX encodings are never mixed.                         */
+/*                                                                          */
+/* Every CPU with AVX2 also has popcnt, so the AVX2 and AVX-512 sets count  */
+/* bits with it; SSE4.1 does not imply popcnt and uses a pshufb lookup.     */
+/****************************************************************************/
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2,popcnt")))
+#define AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,popcnt")))
+
+SSE41 __attribute__((always_inline))
+static inline unsigned int hsum_sse(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+SSE41 __attribute__((always_inline))
+static inline unsigned int sq_diff_sse41(const unsigned char *a, const unsigned char *b, int n) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    UNROLL
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i lo = _mm_cvtepu8_epi16(d);
+        __m128i hi = _mm_unpackhi_epi8(d, zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    return hsum_sse(acc) + sq_diff_scalar(a + i, b + i, n - i);
+}
+
+/*
+ * psadbw sums |a - b| over each 8 bytes into a 64-bit lane, with no
+ * widening, and the sums fit in the low 32 bits of the lanes
+ */
+SSE41 __attribute__((always_inline))
+static inline unsigned int sad_sse41(const unsigned char *a, const unsigned char *b, int n) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    UNROLL
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    return hsum_sse(acc) + sad_scalar(a + i, b + i, n - i);
+}
+
+SSE41 __attribute__((always_inline))
+static inline unsigned int dot_sse41(const unsigned char *a, const unsigned char *b, int n) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    UNROLL
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero),
+                                                _mm_unpackhi_epi8(vb, zero)));
+    }
+    return hsum_sse(acc) + dot_scalar(a + i, b + i, n - i);
+}
+
+/*
+ * The 4x4 tiles keep every partial sum in a register. SSE and AVX2 only have
+ * 16 of them, so they make two passes of 4 queries by 2 images.
+ */
+SSE41 __attribute__((always_inline))
+static inline void dot_4x4_sse41(const short *const q[4], const unsigned char *const t[4],
+                          int n, unsigned int out[16]) {
+    int end = n & ~7;
+    #pragma GCC unroll 4
+    for (int j = 0; j < 4; j += 2) {
+        __m128i acc[4][2];
+        #pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            acc[i][0] = acc[i][1] = _mm_setzero_si128();
+        }
+        UNROLL
+        for (int p = 0; p < end; p += 8) {
+            __m128i t0 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(t[j] + p)));
+            __m128i t1 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(t[j + 1] + p)));
+            #pragma GCC unroll 4
+            for (int i = 0; i < 4; i++) {
+                __m128i qi = _mm_loadu_si128((const __m128i *)(q[i] + p));
+                acc[i][0] = _mm_add_epi32(acc[i][0], _mm_madd_epi16(qi, t0));
+                acc[i][1] = _mm_add_epi32(acc[i][1], _mm_madd_epi16(qi, t1));
+            }
+        }
+        #pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            out[4 * i + j] = hsum_sse(acc[i][0]);
+            out[4 * i + j + 1] = hsum_sse(acc[i][1]);
+        }
+    }
+    dot_4x4_tail(q, t, end, n, out);
+}
+
+/* |row - q| and its square, summed over two rows, for 16 images */
+#define SQ_DIFF_ROW_PAIR_SSE(acc, r0, r1, q0, q1, zero)                          \
+    do {                                                                         \
+        __m128i d0 = _mm_or_si128(_mm_subs_epu8(r0, q0), _mm_subs_epu8(q0, r0)); \
+        __m128i d1 = _mm_or_si128(_mm_subs_epu8(r1, q1), _mm_subs_epu8(q1, r1)); \
+        __m128i lo0 = _mm_unpacklo_epi8(d0, zero), hi0 = _mm_unpackhi_epi8(d0, zero); \
+        __m128i lo1 = _mm_unpacklo_epi8(d1, zero), hi1 = _mm_unpackhi_epi8(d1, zero); \
+        __m128i x;                                                               \
+        x = _mm_unpacklo_epi16(lo0, lo1);                                        \
+        acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(x, x));                    \
+        x = _mm_unpackhi_epi16(lo0, lo1);                                        \
+        acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(x, x));                    \
+        x = _mm_unpacklo_epi16(hi0, hi1);                                        \
+        acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(x, x));                    \
+        x = _mm_unpackhi_epi16(hi0, hi1);                                        \
+        acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(x, x));                    \
+    } while (0)
+
+/*
+ * With only 16 registers, SSE makes one pass per group of 16 images, and
+ * each group is abandoned on its own.
+ */
+SSE41 __attribute__((always_inline))
+static inline void sq_diff_columns_sse41(const unsigned char *block, const unsigned char *q,
+                                  int n, unsigned int bound, unsigned int out[COLUMN_BLOCK]) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i limit = _mm_set1_epi32(bound);
+    unsigned int sums[COLUMN_BLOCK] __attribute__((aligned(16)));
+    for (int g = 0; g < COLUMN_BLOCK; g += 16) {
+        __m128i acc[4] = {zero, zero, zero, zero};
+        const unsigned char *col = block + g;
+        UNROLL
+        for (int p = 0; p < n; p += ABANDON_BLOCK) {
+            int end = n - p < ABANDON_BLOCK ? n : p + ABANDON_BLOCK;
+            int r = p;
+            UNROLL
+            for (; r + 2 <= end; r += 2) {
+                __m128i r0 = _mm_load_si128((const __m128i *)(col + (size_t)r * COLUMN_BLOCK));
+                __m128i r1 = _mm_load_si128((const __m128i *)(col + (size_t)(r + 1) * COLUMN_BLOCK));
+                SQ_DIFF_ROW_PAIR_SSE(acc, r0, r1, _mm_set1_epi8(q[r]), _mm_set1_epi8(q[r + 1]), zero);
+            }
+            if (r < end) {
+                __m128i r0 = _mm_load_si128((const __m128i *)(col + (size_t)r * COLUMN_BLOCK));
+                SQ_DIFF_ROW_PAIR_SSE(acc, r0, zero, _mm_set1_epi8(q[r]), zero, zero);
+            }
+            // Unsigned a > b is max(a, b) != b
+            __m128i least = _mm_min_epu32(_mm_min_epu32(acc[0], acc[1]),
+                                          _mm_min_epu32(acc[2], acc[3]));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_max_epu32(least, limit), limit)) == 0) {
+                break;
+            }
+        }
+        for (int c = 0; c < 4; c++) {
+            _mm_store_si128((__m128i *)(sums + g + 4 * c), acc[c]);
+        }
+    }
+    unscramble_columns(sums, 1, out);
+}
+
+/* Popcount of each nibble from a 16-entry table, summed with psadbw */
+SSE41 __attribute__((always_inline))
+static inline unsigned int hamming_sse41(const unsigned long long *a,
+                                         const unsigned long long *b, int n) {
+    const __m128i table = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int words = (n + 63) / 64;
+    UNROLL
+    for (int i = 0; i < words; i += 2) {
+        __m128i x;
+        if (i + 1 < words) {
+            x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                              _mm_loadu_si128((const __m128i *)(b + i)));
+        } else {
+            x = _mm_xor_si128(_mm_loadl_epi64((const __m128i *)(a + i)),
+                              _mm_loadl_epi64((const __m128i *)(b + i)));
+        }
+        __m128i bits = _mm_add_epi8(_mm_shuffle_epi8(table, _mm_and_si128(x, low)),
+                                    _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(x, 4), low)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bits, zero));
+    }
+    return _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+}
+
+/*
+ * Block sums are below 4096, so their differences fit in signed 16 bits and
+ * are squared with pmaddwd directly. The arrays are padded to 32 entries, so
+ * no tails are left.
+ */
+SSE41 __attribute__((always_inline))
+static inline unsigned long long sq_diff_u16_sse41(const unsigned short *a,
+                                                   const unsigned short *b, int n) {
+    unsigned long long d = 0;
+    for (int i = 0; i < n; i += FLUSH_BLOCK) {
+        int end = n - i < FLUSH_BLOCK ? n : i + FLUSH_BLOCK;
+        __m128i acc = _mm_setzero_si128();
+        UNROLL
+        for (int j = i; j < end; j += 8) {
+            __m128i diff = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + j)),
+                                         _mm_loadu_si128((const __m128i *)(b + j)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, diff));
+        }
+        d += hsum_sse(acc);
+    }
+    return d;
+}
+
+SSE41 __attribute__((always_inline))
+static inline unsigned int sad_u16_sse41(const unsigned short *a, const unsigned short *b, int n) {
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    UNROLL
+    for (int i = 0; i < n; i += 8) {
+        __m128i diff = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(a + i)),
+                                     _mm_loadu_si128((const __m128i *)(b + i)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_abs_epi16(diff), ones));
+    }
+    return hsum_sse(acc);
+}
+
+SSE41 __attribute__((always_inline))
+static inline float sq_diff_f32_sse41(const float *a, const float *b, int n) {
+    __m128 acc = _mm_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 4) {
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+}
+
+/* |a - b| clears the sign bit of the difference */
+SSE41 __attribute__((always_inline))
+static inline float max_diff_f32_sse41(const float *a, const float *b, int n) {
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 m = _mm_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 4) {
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        m = _mm_max_ps(m, _mm_andnot_ps(sign, diff));
+    }
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+/* SSE4.1 has no gather, so sparse dot products stay scalar */
+SSE41 __attribute__((always_inline))
+static inline unsigned int dot_sparse_sse41(const unsigned short *index,
+                                            const unsigned char *values, int nnz,
+                                            const unsigned char *dense) {
+    return dot_sparse_scalar(index, values, nnz, dense);
+}
+
+/*
+ * The rows of two nonzero pixels are interleaved, so pmaddwd multiplies
+ * both by their values and adds the products in one go, per query
+ */
+SSE41 __attribute__((always_inline))
+static inline void dot_sparse_block_sse41(const unsigned short *index,
+                                          const unsigned char *values, int nnz,
+                                          const short *block,
+                                          unsigned int out[SPARSE_QUERIES]) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc[4] = {zero, zero, zero, zero};
+    for (int i = 0; i < nnz; i += 2) {
+        const __m128i *r0 = (const __m128i *)(block + (size_t)index[i] * SPARSE_QUERIES);
+        const __m128i *r1 = i + 1 < nnz
+                          ? (const __m128i *)(block + (size_t)index[i + 1] * SPARSE_QUERIES)
+                          : NULL;
+        __m128i v = _mm_set1_epi32(values[i] | (r1 != NULL ? values[i + 1] << 16 : 0));
+        for (int h = 0; h < 2; h++) {
+            __m128i a = _mm_load_si128(r0 + h);
+            __m128i b = r1 != NULL ? _mm_load_si128(r1 + h) : zero;
+            acc[2 * h] = _mm_add_epi32(acc[2 * h], _mm_madd_epi16(_mm_unpacklo_epi16(a, b), v));
+            acc[2 * h + 1] = _mm_add_epi32(acc[2 * h + 1],
+                                           _mm_madd_epi16(_mm_unpackhi_epi16(a, b), v));
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        _mm_storeu_si128((__m128i *)(out + 4 * k), acc[k]);
+    }
+}
+
+/*
+ * pshufb looks up the 16-entry table of a subspace for 16 codes at once.
+ * The distances are widened to 16 bits before adding, for images 0-7, 8-15
+ * (low nibbles), 16-23 and 24-31 (high nibbles).
+ */
+SSE41 __attribute__((always_inline))
+static inline void pq_scan_sse41(const unsigned char *codes, const unsigned char *luts,
+                                 int subspaces, unsigned short out[PQ_BLOCK]) {
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc[4] = {zero, zero, zero, zero};
+    for (int s = 0; s < subspaces; s++) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(codes + 16 * s));
+        __m128i lut = _mm_loadu_si128((const __m128i *)(luts + 16 * s));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(c, nibble));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(c, 4), nibble));
+        acc[0] = _mm_add_epi16(acc[0], _mm_unpacklo_epi8(lo, zero));
+        acc[1] = _mm_add_epi16(acc[1], _mm_unpackhi_epi8(lo, zero));
+        acc[2] = _mm_add_epi16(acc[2], _mm_unpacklo_epi8(hi, zero));
+        acc[3] = _mm_add_epi16(acc[3], _mm_unpackhi_epi8(hi, zero));
+    }
+    for (int k = 0; k < 4; k++) {
+        _mm_storeu_si128((__m128i *)(out + 8 * k), acc[k]);
+    }
+}
+
+ALL_ENTRIES(sse41, SSE41)
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int hsum_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int sq_diff_avx2(const unsigned char *a, const unsigned char *b, int n) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    UNROLL
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i lo = _mm256_unpacklo_epi8(d, zero);
+        __m256i hi = _mm256_unpackhi_epi8(d, zero);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+    }
+    return hsum_avx2(acc) + sq_diff_sse41(a + i, b + i, n - i);
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int sad_avx2(const unsigned char *a, const unsigned char *b, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    UNROLL
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+    return hsum_avx2(acc) + sad_sse41(a + i, b + i, n - i);
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int dot_avx2(const unsigned char *a, const unsigned char *b, int n) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    UNROLL
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi8(va, zero),
+                                                      _mm256_unpacklo_epi8(vb, zero)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpackhi_epi8(va, zero),
+                                                      _mm256_unpackhi_epi8(vb, zero)));
+    }
+    return hsum_avx2(acc) + dot_sse41(a + i, b + i, n - i);
+}
+
+AVX2 __attribute__((always_inline))
+static inline void dot_4x4_avx2(const short *const q[4], const unsigned char *const t[4],
+                         int n, unsigned int out[16]) {
+    int end = n & ~15;
+    #pragma GCC unroll 4
+    for (int j = 0; j < 4; j += 2) {
+        __m256i acc[4][2];
+        #pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+        }
+        UNROLL
+        for (int p = 0; p < end; p += 16) {
+            __m256i t0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(t[j] + p)));
+            __m256i t1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(t[j + 1] + p)));
+            #pragma GCC unroll 4
+            for (int i = 0; i < 4; i++) {
+                __m256i qi = _mm256_loadu_si256((const __m256i *)(q[i] + p));
+                acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(qi, t0));
+                acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(qi, t1));
+            }
+        }
+        #pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            out[4 * i + j] = hsum_avx2(acc[i][0]);
+            out[4 * i + j + 1] = hsum_avx2(acc[i][1]);
+        }
+    }
+    dot_4x4_tail(q, t, end, n, out);
+}
+
+#define SQ_DIFF_ROW_PAIR_AVX2(acc, r0, r1, q0, q1, zero)                         \
+    do {                                                                         \
+        __m256i d0 = _mm256_or_si256(_mm256_subs_epu8(r0, q0), _mm256_subs_epu8(q0, r0)); \
+        __m256i d1 = _mm256_or_si256(_mm256_subs_epu8(r1, q1), _mm256_subs_epu8(q1, r1)); \
+        __m256i lo0 = _mm256_unpacklo_epi8(d0, zero), hi0 = _mm256_unpackhi_epi8(d0, zero); \
+        __m256i lo1 = _mm256_unpacklo_epi8(d1, zero), hi1 = _mm256_unpackhi_epi8(d1, zero); \
+        __m256i x;                                                               \
+        x = _mm256_unpacklo_epi16(lo0, lo1);                                     \
+        acc[0] = _mm256_add_epi32(acc[0], _mm256_madd_epi16(x, x));              \
+        x = _mm256_unpackhi_epi16(lo0, lo1);                                     \
+        acc[1] = _mm256_add_epi32(acc[1], _mm256_madd_epi16(x, x));              \
+        x = _mm256_unpacklo_epi16(hi0, hi1);                                     \
+        acc[2] = _mm256_add_epi32(acc[2], _mm256_madd_epi16(x, x));              \
+        x = _mm256_unpackhi_epi16(hi0, hi1);                                     \
+        acc[3] = _mm256_add_epi32(acc[3], _mm256_madd_epi16(x, x));              \
+    } while (0)
+
+/* AVX2 makes two passes of 32 images, so its 8 accumulators fit in registers */
+AVX2 __attribute__((always_inline))
+static inline void sq_diff_columns_avx2(const unsigned char *block, const unsigned char *q,
+                                 int n, unsigned int bound, unsigned int out[COLUMN_BLOCK]) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i limit = _mm256_set1_epi32(bound);
+    unsigned int sums[COLUMN_BLOCK] __attribute__((aligned(32)));
+    for (int g = 0; g < COLUMN_BLOCK; g += 32) {
+        __m256i acc[4] = {zero, zero, zero, zero};
+        const unsigned char *col = block + g;
+        UNROLL
+        for (int p = 0; p < n; p += ABANDON_BLOCK) {
+            int end = n - p < ABANDON_BLOCK ? n : p + ABANDON_BLOCK;
+            int r = p;
+            UNROLL
+            for (; r + 2 <= end; r += 2) {
+                __m256i r0 = _mm256_load_si256((const __m256i *)(col + (size_t)r * COLUMN_BLOCK));
+                __m256i r1 = _mm256_load_si256((const __m256i *)(col + (size_t)(r + 1) * COLUMN_BLOCK));
+                SQ_DIFF_ROW_PAIR_AVX2(acc, r0, r1, _mm256_set1_epi8(q[r]), _mm256_set1_epi8(q[r + 1]), zero);
+            }
+            if (r < end) {
+                __m256i r0 = _mm256_load_si256((const __m256i *)(col + (size_t)r * COLUMN_BLOCK));
+                SQ_DIFF_ROW_PAIR_AVX2(acc, r0, zero, _mm256_set1_epi8(q[r]), zero, zero);
+            }
+            __m256i least = _mm256_min_epu32(_mm256_min_epu32(acc[0], acc[1]),
+                                             _mm256_min_epu32(acc[2], acc[3]));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_max_epu32(least, limit), limit)) == 0) {
+                break;
+            }
+        }
+        for (int c = 0; c < 4; c++) {
+            _mm256_store_si256((__m256i *)(sums + g + 8 * c), acc[c]);
+        }
+    }
+    unscramble_columns(sums, 2, out);
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int hamming_avx2(const unsigned long long *a,
+                                        const unsigned long long *b, int n) {
+    unsigned int d = 0;
+    UNROLL
+    for (int i = 0; i < (n + 63) / 64; i++) {
+        d += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return d;
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned long long sq_diff_u16_avx2(const unsigned short *a,
+                                                  const unsigned short *b, int n) {
+    unsigned long long d = 0;
+    for (int i = 0; i < n; i += FLUSH_BLOCK) {
+        int end = n - i < FLUSH_BLOCK ? n : i + FLUSH_BLOCK;
+        __m256i acc = _mm256_setzero_si256();
+        UNROLL
+        for (int j = i; j < end; j += 16) {
+            __m256i diff = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + j)),
+                                            _mm256_loadu_si256((const __m256i *)(b + j)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+        }
+        d += hsum_avx2(acc);
+    }
+    return d;
+}
+
+AVX2 __attribute__((always_inline))
+static inline unsigned int sad_u16_avx2(const unsigned short *a, const unsigned short *b, int n) {
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    UNROLL
+    for (int i = 0; i < n; i += 16) {
+        __m256i diff = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                        _mm256_loadu_si256((const __m256i *)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_abs_epi16(diff), ones));
+    }
+    return hsum_avx2(acc);
+}
+
+AVX2 __attribute__((always_inline))
+static inline float sq_diff_f32_avx2(const float *a, const float *b, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+AVX2 __attribute__((always_inline))
+static inline float max_diff_f32_avx2(const float *a, const float *b, int n) {
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m = _mm256_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        m = _mm256_max_ps(m, _mm256_andnot_ps(sign, diff));
+    }
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+/*
+ * Gathers 32 bits at each byte offset of `dense` and keeps the low byte.
+ * Both factors fit in 16 bits, so pmaddwd multiplies them, with the zero
+ * upper halves adding nothing.
+ */
+AVX2 __attribute__((always_inline))
+static inline unsigned int dot_sparse_avx2(const unsigned short *index,
+                                           const unsigned char *values, int nnz,
+                                           const unsigned char *dense) {
+    __m256i low_byte = _mm256_set1_epi32(0xff);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= nnz; i += 8) {
+        __m256i idx = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(index + i)));
+        __m256i q = _mm256_and_si256(_mm256_i32gather_epi32((const int *)dense, idx, 1),
+                                     low_byte);
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(values + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(q, v));
+    }
+    return hsum_avx2(acc) + dot_sparse_scalar(index + i, values + i, nnz - i, dense);
+}
+
+/*
+ * Like dot_sparse_block_sse41, on whole rows. The unpacks work within 128-bit
+ * lanes, so the accumulators hold queries 0-3 and 8-11, and 4-7 and 12-15.
+ */
+AVX2 __attribute__((always_inline))
+static inline void dot_sparse_block_avx2(const unsigned short *index,
+                                         const unsigned char *values, int nnz,
+                                         const short *block,
+                                         unsigned int out[SPARSE_QUERIES]) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 2 <= nnz; i += 2) {
+        __m256i a = _mm256_load_si256((const __m256i *)(block + (size_t)index[i] * SPARSE_QUERIES));
+        __m256i b = _mm256_load_si256(
+            (const __m256i *)(block + (size_t)index[i + 1] * SPARSE_QUERIES));
+        __m256i v = _mm256_set1_epi32(values[i] | values[i + 1] << 16);
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), v));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), v));
+    }
+    if (i < nnz) {
+        __m256i a = _mm256_load_si256((const __m256i *)(block + (size_t)index[i] * SPARSE_QUERIES));
+        __m256i zero = _mm256_setzero_si256();
+        __m256i v = _mm256_set1_epi32(values[i]);
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), v));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), v));
+    }
+    _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(acc0, acc1, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 8), _mm256_permute2x128_si256(acc0, acc1, 0x31));
+}
+
+/*
+ * Like pq_scan_sse41, two subspaces at a time: vpshufb looks up within
+ * 128-bit lanes, so each lane takes one subspace, and the lanes are added
+ * at the end
+ */
+AVX2 __attribute__((always_inline))
+static inline void pq_scan_avx2(const unsigned char *codes, const unsigned char *luts,
+                                int subspaces, unsigned short out[PQ_BLOCK]) {
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc[4] = {zero, zero, zero, zero};
+    for (int s = 0; s < subspaces; s += 2) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(codes + 16 * s));
+        __m256i lut = _mm256_loadu_si256((const __m256i *)(luts + 16 * s));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(c, nibble));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+        acc[0] = _mm256_add_epi16(acc[0], _mm256_unpacklo_epi8(lo, zero));
+        acc[1] = _mm256_add_epi16(acc[1], _mm256_unpackhi_epi8(lo, zero));
+        acc[2] = _mm256_add_epi16(acc[2], _mm256_unpacklo_epi8(hi, zero));
+        acc[3] = _mm256_add_epi16(acc[3], _mm256_unpackhi_epi8(hi, zero));
+    }
+    for (int k = 0; k < 4; k++) {
+        __m128i sum = _mm_add_epi16(_mm256_castsi256_si128(acc[k]),
+                                    _mm256_extracti128_si256(acc[k], 1));
+        _mm_storeu_si128((__m128i *)(out + 8 * k), sum);
+    }
+}
+
+ALL_ENTRIES(avx2, AVX2)
+
+/* The AVX-512 kernels finish with a masked load instead of a scalar tail */
+AVX512 __attribute__((always_inline))
+static inline __mmask64 tail_mask(int left) {
+    return left >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << left) - 1;
+}
+
+AVX512 __attribute__((always_inline))
+static inline unsigned int sq_diff_avx512(const unsigned char *a, const unsigned char *b, int n) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc = _mm512_setzero_si512();
+    UNROLL
+    for (int i = 0; i < n; i += 64) {
+        __mmask64 m = tail_mask(n - i);
+        __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+        __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+        __m512i d = _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+        __m512i lo = _mm512_unpacklo_epi8(d, zero);
+        __m512i hi = _mm512_unpackhi_epi8(d, zero);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+AVX512 __attribute__((always_inline))
+static inline unsigned int sad_avx512(const unsigned char *a, const unsigned char *b, int n) {
+    __m512i acc = _mm512_setzero_si512();
+    UNROLL
+    for (int i = 0; i < n; i += 64) {
+        __mmask64 m = tail_mask(n - i);
+        __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+        __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(va, vb));
+    }
+    return _mm512_reduce_add_epi64(acc);
+}
+
+AVX512 __attribute__((always_inline))
+static inline unsigned int dot_avx512(const unsigned char *a, const unsigned char *b, int n) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc = _mm512_setzero_si512();
+    UNROLL
+    for (int i = 0; i < n; i += 64) {
+        __mmask64 m = tail_mask(n - i);
+        __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+        __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_unpacklo_epi8(va, zero),
+                                                      _mm512_unpacklo_epi8(vb, zero)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_unpackhi_epi8(va, zero),
+                                                      _mm512_unpackhi_epi8(vb, zero)));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+/*
+ * The last block of the images is read with a masked load; the queries are
+ * zero padded, so they need no mask.
+ */
+AVX512 __attribute__((always_inline))
+static inline void dot_4x4_avx512(const short *const q[4], const unsigned char *const t[4],
+                           int n, unsigned int out[16]) {
+    __m512i acc[4][4];
+    #pragma GCC unroll 4
+    for (int i = 0; i < 4; i++) {
+        #pragma GCC unroll 4
+        for (int j = 0; j < 4; j++) {
+            acc[i][j] = _mm512_setzero_si512();
+        }
+    }
+    UNROLL
+    for (int p = 0; p < n; p += 32) {
+        __mmask32 m = n - p >= 32 ? ~(__mmask32)0 : ((__mmask32)1 << (n - p)) - 1;
+        __m512i tj[4];
+        #pragma GCC unroll 4
+        for (int j = 0; j < 4; j++) {
+            tj[j] = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(m, t[j] + p));
+        }
+        #pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            __m512i qi = _mm512_loadu_si512(q[i] + p);
+            #pragma GCC unroll 4
+            for (int j = 0; j < 4; j++) {
+                acc[i][j] = _mm512_add_epi32(acc[i][j], _mm512_madd_epi16(qi, tj[j]));
+            }
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            out[4 * i + j] = _mm512_reduce_add_epi32(acc[i][j]);
+        }
+    }
+}
+
+/* One register holds a whole row of the block, so AVX-512 makes one pass */
+AVX512 __attribute__((always_inline))
+static inline void sq_diff_columns_avx512(const unsigned char *block, const unsigned char *q,
+                                   int n, unsigned int bound, unsigned int out[COLUMN_BLOCK]) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i limit = _mm512_set1_epi32(bound);
+    __m512i acc[4] = {zero, zero, zero, zero};
+    unsigned int sums[COLUMN_BLOCK] __attribute__((aligned(64)));
+    UNROLL
+    for (int p = 0; p < n; p += ABANDON_BLOCK) {
+        int end = n - p < ABANDON_BLOCK ? n : p + ABANDON_BLOCK;
+        UNROLL
+        for (int r = p; r < end; r += 2) {
+            __m512i r0 = _mm512_load_si512(block + (size_t)r * COLUMN_BLOCK);
+            __m512i q0 = _mm512_set1_epi8(q[r]);
+            __m512i r1 = zero, q1 = zero;
+            if (r + 1 < end) {
+                r1 = _mm512_load_si512(block + (size_t)(r + 1) * COLUMN_BLOCK);
+                q1 = _mm512_set1_epi8(q[r + 1]);
+            }
+            __m512i d0 = _mm512_or_si512(_mm512_subs_epu8(r0, q0), _mm512_subs_epu8(q0, r0));
+            __m512i d1 = _mm512_or_si512(_mm512_subs_epu8(r1, q1), _mm512_subs_epu8(q1, r1));
+            __m512i lo0 = _mm512_unpacklo_epi8(d0, zero), hi0 = _mm512_unpackhi_epi8(d0, zero);
+            __m512i lo1 = _mm512_unpacklo_epi8(d1, zero), hi1 = _mm512_unpackhi_epi8(d1, zero);
+            __m512i x;
+            x = _mm512_unpacklo_epi16(lo0, lo1);
+            acc[0] = _mm512_add_epi32(acc[0], _mm512_madd_epi16(x, x));
+            x = _mm512_unpackhi_epi16(lo0, lo1);
+            acc[1] = _mm512_add_epi32(acc[1], _mm512_madd_epi16(x, x));
+            x = _mm512_unpacklo_epi16(hi0, hi1);
+            acc[2] = _mm512_add_epi32(acc[2], _mm512_madd_epi16(x, x));
+            x = _mm512_unpackhi_epi16(hi0, hi1);
+            acc[3] = _mm512_add_epi32(acc[3], _mm512_madd_epi16(x, x));
+        }
+        __m512i least = _mm512_min_epu32(_mm512_min_epu32(acc[0], acc[1]),
+                                         _mm512_min_epu32(acc[2], acc[3]));
+        if (_mm512_cmple_epu32_mask(least, limit) == 0) {
+            break;
+        }
+    }
+    for (int c = 0; c < 4; c++) {
+        _mm512_store_si512(sums + 16 * c, acc[c]);
+    }
+    unscramble_columns(sums, 4, out);
+}
+
+/* Counting bits in vectors needs AVX512_VPOPCNTDQ, so popcnt is used */
+#define hamming_avx512 hamming_avx2
+
+AVX512 __attribute__((always_inline))
+static inline unsigned long long sq_diff_u16_avx512(const unsigned short *a,
+                                                    const unsigned short *b, int n) {
+    unsigned long long d = 0;
+    for (int i = 0; i < n; i += FLUSH_BLOCK) {
+        int end = n - i < FLUSH_BLOCK ? n : i + FLUSH_BLOCK;
+        __m512i acc = _mm512_setzero_si512();
+        UNROLL
+        for (int j = i; j < end; j += 32) {
+            __m512i diff = _mm512_sub_epi16(_mm512_loadu_si512(a + j), _mm512_loadu_si512(b + j));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff, diff));
+        }
+        d += (unsigned int)_mm512_reduce_add_epi32(acc);
+    }
+    return d;
+}
+
+AVX512 __attribute__((always_inline))
+static inline unsigned int sad_u16_avx512(const unsigned short *a, const unsigned short *b, int n) {
+    __m512i ones = _mm512_set1_epi16(1);
+    __m512i acc = _mm512_setzero_si512();
+    UNROLL
+    for (int i = 0; i < n; i += 32) {
+        __m512i diff = _mm512_sub_epi16(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_abs_epi16(diff), ones));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+AVX512 __attribute__((always_inline))
+static inline float sq_diff_f32_avx512(const float *a, const float *b, int n) {
+    __m512 acc = _mm512_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 16) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(diff, diff));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+AVX512 __attribute__((always_inline))
+static inline float max_diff_f32_avx512(const float *a, const float *b, int n) {
+    __m512 m = _mm512_setzero_ps();
+    UNROLL
+    for (int i = 0; i < n; i += 16) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        m = _mm512_max_ps(m, _mm512_abs_ps(diff));
+    }
+    return _mm512_reduce_max_ps(m);
+}
+
+/* Like dot_sparse_avx2, with the last lanes masked off */
+AVX512 __attribute__((always_inline))
+static inline unsigned int dot_sparse_avx512(const unsigned short *index,
+                                             const unsigned char *values, int nnz,
+                                             const unsigned char *dense) {
+    __m512i low_byte = _mm512_set1_epi32(0xff);
+    __m512i acc = _mm512_setzero_si512();
+    for (int i = 0; i < nnz; i += 16) {
+        __mmask16 m = nnz - i >= 16 ? 0xffff : (1u << (nnz - i)) - 1;
+        __m512i idx = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(m, index + i));
+        __m512i q = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), m, idx, dense, 1);
+        __m512i v = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(m, values + i));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_and_si512(q, low_byte), v));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+/* A row of 16 queries fills 256 bits, so the AVX2 body is as wide as it gets */
+AVX512 __attribute__((always_inline))
+static inline void dot_sparse_block_avx512(const unsigned short *index,
+                                           const unsigned char *values, int nnz,
+                                           const short *block,
+                                           unsigned int out[SPARSE_QUERIES]) {
+    dot_sparse_block_avx2(index, values, nnz, block, out);
+}
+
+/* Like pq_scan_avx2, four subspaces at a time */
+AVX512 __attribute__((always_inline))
+static inline void pq_scan_avx512(const unsigned char *codes, const unsigned char *luts,
+                                  int subspaces, unsigned short out[PQ_BLOCK]) {
+    __m512i nibble = _mm512_set1_epi8(0x0f);
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc[4] = {zero, zero, zero, zero};
+    for (int s = 0; s < subspaces; s += 4) {
+        __m512i c = _mm512_loadu_si512(codes + 16 * s);
+        __m512i lut = _mm512_loadu_si512(luts + 16 * s);
+        __m512i lo = _mm512_shuffle_epi8(lut, _mm512_and_si512(c, nibble));
+        __m512i hi = _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(c, 4), nibble));
+        acc[0] = _mm512_add_epi16(acc[0], _mm512_unpacklo_epi8(lo, zero));
+        acc[1] = _mm512_add_epi16(acc[1], _mm512_unpackhi_epi8(lo, zero));
+        acc[2] = _mm512_add_epi16(acc[2], _mm512_unpacklo_epi8(hi, zero));
+        acc[3] = _mm512_add_epi16(acc[3], _mm512_unpackhi_epi8(hi, zero));
+    }
+    for (int k = 0; k < 4; k++) {
+        __m256i half = _mm256_add_epi16(_mm512_castsi512_si256(acc[k]),
+                                        _mm512_extracti64x4_epi64(acc[k], 1));
+        __m128i sum = _mm_add_epi16(_mm256_castsi256_si128(half),
+                                    _mm256_extracti128_si256(half, 1));
+        _mm_storeu_si128((__m128i *)(out + 8 * k), sum);
+    }
+}
+
+ALL_ENTRIES(avx512, AVX512)
+#endif
+
+/* Every kernel set, fastest first, each followed by its specialized sets */
+static const Kernels kernel_sets[][1 + NUM_GEOMETRIES] = {
+#if defined(__x86_64__) || defined(__i386__)
+    ALL_SETS("avx512", avx512),
+    ALL_SETS("avx2", avx2),
+    ALL_SETS("sse4.1", sse41),
+#endif
+    ALL_SETS("scalar", scalar),
+};
+#define NUM_KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+Kernels kernels = KERNEL_SET("scalar", scalar, any, 0);
+
+/* The instruction set picked by select_kernels, as an index in kernel_sets */
+static int selected_set = NUM_KERNEL_SETS - 1;
+
+/* Return 1 if the CPU can run the kernel set called `name` */
+static int cpu_supports(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vl");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(name, "sse4.1") == 0) {
+        return __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+/**
+ * Runs before main, so every child forked by the classifier inherits the
+ * choice. KNN_KERNELS can only select a set the CPU supports; naming any
+ * other prints a warning and leaves the scalar set, so a run never claims
+ * kernels it did not use.
+ */
+__attribute__((constructor))
+static void select_kernels(void) {
+    const char *forced = getenv("KNN_KERNELS");
+    for (int i = 0; i < NUM_KERNEL_SETS; i++) {
+        if (cpu_supports(kernel_sets[i][0].name) &&
+            (forced == NULL || strcmp(forced, kernel_sets[i][0].name) == 0)) {
+            kernels = kernel_sets[i][0];
+            selected_set = i;
+            return;
+        }
+    }
+    fprintf(stderr, "Warning: KNN_KERNELS=%s is not a kernel set this CPU supports, "
+            "using the %s kernels\n", forced, kernels.name);
+}
+
+/**
+ * Return the kernels specialized for images of `pixels` pixels in the
+ * selected instruction set, or the generic `kernels` if there are none.
+ */
+const Kernels *kernels_for_size(int pixels) {
+    for (int g = 1; g <= NUM_GEOMETRIES; g++) {
+        if (kernel_sets[selected_set][g].pixels == pixels) {
+            return &kernel_sets[selected_set][g];
+        }
+    }
+    return &kernels;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+/* Images per block of the pixel-major layout used by sq_diff_columns */
+#define COLUMN_BLOCK 64
+
+/* Queries per row of the pixel-major query block used by dot_sparse_block */
+#define SPARSE_QUERIES 16
+
+/* Images per block of 4-bit codes scanned by pq_scan */
+#define PQ_BLOCK 32
+
+/**
+ * Pixel kernels shared by the distance functions. Every kernel works on two
+ * arrays of `n` unsigned 8-bit pixels and sums in 32-bit integers, which is
+ * exact for images of up to 66049 pixels.
+ *
+ * `kernels` holds the fastest implementation the CPU supports. It is picked
+ * once at startup by probing CPUID; setting the environment variable
+ * KNN_KERNELS to the name of a slower set (e.g. "scalar") forces that one.
+ * Naming a set the CPU lacks warns and falls back to the scalar set.
+ *
+ * Every set also comes specialized for the common image sizes 28x28, 32x32,
+ * 64x64 and 96x96, with fixed trip counts; kernels_for_size() returns the
+ * one matching an image size. Those kernels ignore `n`, which must be the
+ * size they were built for.
+ */
+typedef struct Kernels {
+    const char *name;
+    int pixels;  // Image size the set is specialized for, or 0 for any
+    // sum((a[i] - b[i])^2)
+    unsigned int (*sq_diff)(const unsigned char *a, const unsigned char *b, int n);
+    // sum(a[i] * b[i])
+    unsigned int (*dot)(const unsigned char *a, const unsigned char *b, int n);
+    // sum((a[i] - b[i])^2) if it is at most `bound`, otherwise some partial
+    // sum above `bound`, returned as soon as one is found
+    unsigned int (*sq_diff_bounded)(const unsigned char *a, const unsigned char *b,
+                                    int n, unsigned int bound);
+    // sum(|a[i] - b[i]|)
+    unsigned int (*sad)(const unsigned char *a, const unsigned char *b, int n);
+    // sum(|a[i] - b[i]|), abandoned above `bound` like sq_diff_bounded
+    unsigned int (*sad_bounded)(const unsigned char *a, const unsigned char *b,
+                                int n, unsigned int bound);
+    // Register-tiled block of dot products: out[4 * i + j] = sum(q[i][p] * t[j][p])
+    // for 4 images `q` already widened to 16 bits, and zero padded to a
+    // multiple of 32 pixels, and 4 images `t`
+    void (*dot_4x4)(const short *const q[4], const unsigned char *const t[4],
+                    int n, unsigned int out[16]);
+    // Query against a pixel-major block of COLUMN_BLOCK images, whose row p
+    // holds pixel p of every image, 64-byte aligned:
+    // out[j] = sum((block[p][j] - q[p])^2).
+    // Once every sum of the block is above `bound` it stops early and leaves
+    // partial sums above `bound`
+    void (*sq_diff_columns)(const unsigned char *block, const unsigned char *q,
+                            int n, unsigned int bound, unsigned int out[COLUMN_BLOCK]);
+    // Number of differing bits among the first n of two bit arrays, padded
+    // with zero bits to a whole number of 64-bit words
+    unsigned int (*hamming)(const unsigned long long *a, const unsigned long long *b, int n);
+    // sum((a[i] - b[i])^2) over two arrays of `n` 16-bit block sums below 4096,
+    // zero padded to a multiple of 32 entries. Not specialized by image size
+    unsigned long long (*sq_diff_u16)(const unsigned short *a, const unsigned short *b, int n);
+    // sum(|a[i] - b[i]|) over the same arrays
+    unsigned int (*sad_u16)(const unsigned short *a, const unsigned short *b, int n);
+    // sum((a[i] - b[i])^2) over two arrays of `n` floats, zero padded to a
+    // multiple of 16. Not specialized by image size
+    float (*sq_diff_f32)(const float *a, const float *b, int n);
+    // max(|a[i] - b[i]|) over the same
+    float (*max_diff_f32)(const float *a, const float *b, int n);
+    // sum(values[i] * dense[index[i]]) over the `nnz` nonzero pixels of a
+    // sparse image. `dense` must stay readable for 3 bytes past the last
+    // pixel. Not specialized by image size
+    unsigned int (*dot_sparse)(const unsigned short *index, const unsigned char *values,
+                               int nnz, const unsigned char *dense);
+    // Dot products of one sparse image with a pixel-major block of
+    // SPARSE_QUERIES queries widened to 16 bits, whose 32-byte aligned row p
+    // holds pixel p of every query: out[q] = sum(values[i] * block[index[i]][q])
+    void (*dot_sparse_block)(const unsigned short *index, const unsigned char *values,
+                             int nnz, const short *block, unsigned int out[SPARSE_QUERIES]);
+    // Product quantization fast-scan over a block of PQ_BLOCK images with a
+    // 4-bit code per subspace: out[j] = sum(luts[s][code of image j in s]).
+    // Row s of `codes` is 16 bytes holding the code of image j in the low
+    // nibble of byte j and that of image j + 16 in the high one; `luts`
+    // holds 16 entries per subspace. `subspaces` is a multiple of 4, and the
+    // sums must fit in 16 bits
+    void (*pq_scan)(const unsigned char *codes, const unsigned char *luts, int subspaces,
+                    unsigned short out[PQ_BLOCK]);
+    // Fractions of nonzero pixels below which dot_sparse beats dot, and
+    // dot_sparse_block beats dot_4x4
+    float sparse_density;
+    float sparse_block_density;
+} Kernels;
+
+extern Kernels kernels;
+
+const Kernels *kernels_for_size(int pixels);
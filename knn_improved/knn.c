@@ -3,120 +3,3499 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <math.h>    
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "knn.h"
+#include "kernels.h"
+
+/* Start of a dataset file whose header names the image geometry */
+#define GEOMETRY_MAGIC "KNNG"
+
+/* Largest image the 32-bit kernel sums are exact for */
+#define MAX_PIXELS 66049
+
+/* In-memory layout: every image starts on a cache line and is zero padded */
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define CACHE_LINE 64
+
+/* Pixels at least this bright are set in the 1-bit copy of an image */
+#define BINARY_THRESHOLD 128
+
+/* Block sum arrays are zero padded to a multiple of this many entries */
+#define SUMS_ALIGN 32
+
+/*
+ * PCA is fitted to at most PCA_SAMPLE images spread over the training set,
+ * with PCA_ROUNDS rounds of subspace iteration. The covariance matrix has
+ * a square of the pixel count entries, which bounds the image size.
+ */
+#define PCA_SAMPLE 10000
+#define PCA_ROUNDS 30
+#define PCA_MAX_PIXELS 1024
+
+/*
+ * k-means of the inverted file (see ivf_training) runs IVF_ROUNDS rounds
+ * over at most IVF_SAMPLE images spread over the training set, both for the
+ * cells and for the PQ_CODES centroids of every subspace of PQ_DIMS pixels.
+ * The subspaces are padded to a multiple of PQ_SUBSPACE_ALIGN for pq_scan.
+ */
+#define IVF_SAMPLE 10000
+#define IVF_ROUNDS 10
+#define PQ_DIMS 8
+#define PQ_CODES 16
+#define PQ_SUBSPACE_ALIGN 4
+
+/*
+ * Float arrays kept per image (projections, pivot distances) are zero padded
+ * to a multiple of this many entries, as the float kernels expect
+ */
+#define FLOAT_ALIGN 16
+
+/* Start of a file holding a fitted projection (see project_training) */
+#define PROJECTION_MAGIC "KNNP"
+#define PROJECTION_VERSION 1
+
+/* Slack for rounding in the norms of the norm-ordered search */
+#define NORM_SLACK 1e-6
+
+/*
+ * Slack for rounding in the float distances of the pivot table and of the
+ * vantage-point tree
+ */
+#define PIVOT_SLACK 0.01
+
+/* Start of a file holding a vantage-point tree (see vp_tree_training) */
+#define VP_TREE_MAGIC "KNNV"
+#define VP_TREE_VERSION 1
+
+/* Subtrees of the vantage-point tree with at most this many images are leaves */
+#define VP_LEAF 32
+
+/*
+ * Graph index (see hnsw_training): candidates kept while inserting an image,
+ * and the start of a file holding a graph
+ */
+#define HNSW_BUILD_EF 128
+#define HNSW_MAGIC "KNNH"
+#define HNSW_VERSION 1
+
+/* Start of an index file (see write_index) */
+#define INDEX_MAGIC "KNNX"
+#define INDEX_VERSION 2
+
+/*
+ * Block sizes of knn_predict_batch; BATCH_TRAIN images stay in L2, and a
+ * block of queries is what dot_sparse_block takes
+ */
+#define BATCH_QUERIES SPARSE_QUERIES
+#define BATCH_TRAIN 256
+
+/*
+ * Training images per call of a metric's score function. It is a multiple of
+ * COLUMN_BLOCK, so blocks of the pixel-major copy are never split.
+ */
+#define SCORE_BLOCK COLUMN_BLOCK
+
+/* Header of a saved projection, followed by its offset and axes */
+typedef struct {
+    char magic[4];            // PROJECTION_MAGIC
+    int version;              // PROJECTION_VERSION
+    int pixels;               // Pixels per image
+    int components;           // Components asked for, before padding
+    unsigned long long hash;  // hash_images() of the training set it fits
+} Projection_header;
+
+/* Header of a saved vantage-point tree, followed by its order and bounds */
+typedef struct {
+    char magic[4];            // VP_TREE_MAGIC
+    int version;              // VP_TREE_VERSION
+    int num_items;            // Images in the tree
+    int leaf;                 // VP_LEAF of the tree
+    unsigned long long hash;  // hash_images() of the training set it covers
+} Vp_tree_header;
+
+/*
+ * Header of a saved graph. The upper_start, links0 and links arrays follow,
+ * each starting on a cache line, so that the file can be mapped and used
+ * in place.
+ */
+typedef struct {
+    char magic[4];            // HNSW_MAGIC
+    int version;              // HNSW_VERSION
+    int num_items;            // Images in the graph
+    int M;                    // Links per image on the upper layers
+    int entry;                // Image the search starts from
+    int max_level;            // Level of `entry`
+    int num_upper;            // Rows of links on the upper layers
+    int reserved;             // Zero
+    unsigned long long hash;  // hash_images() of the training set it covers
+} Hnsw_header;
+
+/* The arrays of an index file, in the order they are stored */
+enum {
+    INDEX_LABELS, INDEX_NORMS, INDEX_SQ_NORMS, INDEX_PIXEL_ORDER, INDEX_PIXELS,
+    INDEX_BLOCK_SUMS, INDEX_SPARSE_START, INDEX_SPARSE_INDEX, INDEX_SPARSE_VALUES,
+    INDEX_PIVOTS, INDEX_PIVOT_DISTS, INDEX_UPPER_START, INDEX_LINKS0, INDEX_LINKS,
+    INDEX_VP_ORDER, INDEX_VP_BOUNDS, INDEX_PCA_OFFSET, INDEX_PCA_AXES, INDEX_PROJECTED,
+    INDEX_IVF_CENTROIDS, INDEX_IVF_CODEBOOKS, INDEX_IVF_CELL_TERMS, INDEX_IVF_CELL_START,
+    INDEX_IVF_IDS, INDEX_IVF_CODES,
+    INDEX_ARRAYS
+};
+
+/*
+ * Header of an index file. The arrays follow in INDEX_ARRAYS order, each
+ * starting on a cache line, with lengths that follow from the header (see
+ * index_layout); absent ones are empty.
+ */
+typedef struct {
+    char magic[4];            // INDEX_MAGIC
+    int version;              // INDEX_VERSION
+    int num_items;            // Images in the training set
+    int sx, sy;               // Geometry of every image
+    int num_pixels;           // Pixels stored per image
+    int stride;               // Bytes from one image to the next
+    int sums_stride;          // Entries per image of the block sums, or 0
+    int sparse;               // 1 if the nonzero pixels are listed
+    float density;            // Fraction of nonzero pixels, if they are
+    unsigned long long nnz;   // Number of nonzero pixels, if they are
+    int num_pivots;           // Pivots of the pivot table, or 0
+    int pivot_stride;         // Distances per image of the pivot table
+    int M;                    // Links per image of the graph, or 0
+    int ef;                   // Candidates the graph search keeps
+    int entry;                // Image the graph search starts from
+    int max_level;            // Level of `entry`
+    int num_upper;            // Rows of links on the upper layers
+    int vp_leaf;              // VP_LEAF of the vantage-point tree, or 0
+    int shortlist;            // Shortlist of the projection or inverted
+                              // file, as a multiple of K
+    int components;           // Components of the projection, or 0
+    int num_cells;            // Cells of the inverted file, or 0
+    int nprobe;               // Cells its search probes
+    int num_blocks;           // Blocks of PQ_BLOCK images of its codes
+    int reserved;             // Zero
+    unsigned long long hash;  // dataset_hash() of the training file
+} Index_header;
+
+/* Where the images of a dataset file are, as read from its header */
+typedef struct {
+    int num_items;       // Number of records
+    int sx, sy;          // Geometry of every image
+    size_t header_size;  // Bytes before the first record
+    size_t record_size;  // Bytes per record: the label, then sx * sy pixels
+} File_layout;
+
+/**
+ * A linear projection of images onto their first principal components,
+ * fitted to a training set by project_training. An image x in the training
+ * set's pixel order projects to sum(x[p] * axes[p]) - offset.
+ */
+typedef struct Projection {
+    int pixels;      // Pixels per image
+    int components;  // Components asked for
+    int dims;        // Components kept, zero padded to a multiple of 16
+    float *offset;   // `dims` entries: the projection of the mean image
+    float *axes;     // `pixels` rows of `dims` entries: the weight of each
+                     // pixel in every component
+} Projection;
+
+/**
+ * A vantage-point tree over the images of a training set, built by
+ * vp_tree_training. The subtree at positions lo to hi - 1 of `order` is a
+ * leaf scanned whole if it holds at most VP_LEAF images. Otherwise image
+ * order[lo] is its vantage point, and the images nearer to it are in the
+ * inner subtree at positions lo + 1 to mid - 1, the others in the outer one
+ * at mid to hi - 1, where mid = lo + 1 + (hi - lo - 1) / 2.
+ */
+typedef struct Vp_tree {
+    int *order;      // Index of the image at each position of the tree
+    float *bounds;   // 4 entries per position: the smallest and largest
+                     // euclidean distances to the vantage point there of the
+                     // images of the inner subtree, then of the outer one
+    struct Dataset *images; // Copy of the images in tree order
+} Vp_tree;
+
+/**
+ * A hierarchical navigable small world graph over the images of a training
+ * set, built by hnsw_training. Every image has a random level and links to
+ * nearby images on layer 0 and on every layer up to its level; a search
+ * walks greedily down from `entry` through the sparse upper layers, then
+ * explores layer 0. Rows of links start with their number of links.
+ */
+typedef struct Hnsw {
+    int M;             // Links per image on layers above 0; 2 M on layer 0
+    int ef;            // Candidates the search of layer 0 keeps
+    int entry;         // Image the search starts from
+    int max_level;     // Level of `entry`, the highest one
+    int *upper_start;  // `num_items + 1` entries: the rows of image i on its
+                       // layers 1 and up are upper_start[i] to
+                       // upper_start[i + 1] - 1 of `links`
+    int *links0;       // 1 + 2 M ints per image: its row on layer 0
+    int *links;        // 1 + M ints per row on the upper layers
+    void *map;         // Mapping of the file the graph was read from, or
+    size_t map_len;    // NULL if it was built in memory
+} Hnsw;
+
+/**
+ * An inverted file over the images of a training set, built by
+ * ivf_training. k-means splits the images into cells, and every image is
+ * stored as its cell and a product-quantized code of its residual from the
+ * cell's centroid: one 4-bit code per subspace of PQ_DIMS pixels, naming
+ * one of 16 centroids of that subspace. The codes of each cell come in
+ * blocks of PQ_BLOCK images, laid out for the pq_scan kernel.
+ */
+typedef struct Ivf {
+    int num_cells;             // k-means cells
+    int nprobe;                // Cells searched per query
+    int subspaces;             // Subspaces, padded with unused ones to a
+                               // multiple of 4
+    unsigned char *centroids;  // Rounded centroid of each cell, in the stored
+                               // pixel order and zero padded to a cache line
+    float *codebooks;          // Centroids of the residuals: pixel t of code k
+                               // of subspace s is entry (s * PQ_DIMS + t) * 16 + k
+    float *cell_terms;         // 16 entries per subspace per cell: |y|^2 + 2 c.y
+                               // for each code y of the subspace, where c is
+                               // the cell's centroid (see ivf_training)
+    int *cell_start;           // `num_cells + 1` entries: the blocks of cell c
+                               // are cell_start[c] to cell_start[c + 1] - 1
+    int *ids;                  // PQ_BLOCK image indexes per block, -1 for
+                               // the unused slots at the end of a cell
+    unsigned char *codes;      // 16 bytes per subspace per block
+} Ivf;
+
+/**
+ * Open the dataset file `filename`, read its header into `layout` and check
+ * that the file really holds that many records. Returns the open file
+ * descriptor, or -1 if the file does not exist.
+ */
+static int open_dataset(const char *filename, File_layout *layout, size_t *file_len) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    int header[4];
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    if (got >= (ssize_t)sizeof(header) && memcmp(header, GEOMETRY_MAGIC, sizeof(int)) == 0) {
+        layout->sx = header[1];
+        layout->sy = header[2];
+        layout->num_items = header[3];
+        layout->header_size = sizeof(header);
+        if (layout->sx <= 0 || layout->sy <= 0 || layout->sx > MAX_PIXELS / layout->sy) {
+            fprintf(stderr, "Error: %s has unsupported %dx%d images\n", filename,
+                    layout->sx, layout->sy);
+            exit(1);
+        }
+    } else if (got >= (ssize_t)sizeof(int)) {
+        layout->sx = WIDTH;
+        layout->sy = WIDTH;
+        layout->num_items = header[0];
+        layout->header_size = sizeof(int);
+    } else {
+        layout->num_items = -1;
+    }
+    if (layout->num_items < 0) {
+        fprintf(stderr, "Could not read num items from %s\n", filename);
+        exit(1);
+    }
+    layout->record_size = 1 + (size_t)layout->sx * layout->sy;
+    *file_len = st.st_size;
+    if (*file_len < layout->header_size + (size_t)layout->num_items * layout->record_size) {
+        fprintf(stderr, "Error: %s is too short for %d images\n", filename, layout->num_items);
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Reserve one anonymous region holding the Dataset struct, its norms and its
+ * labels, followed by `data_len` bytes starting on a `data_align` boundary. The
+ * whole region is owned by the returned dataset, so free_dataset is a
+ * single munmap no matter how the dataset was loaded.
+ */
+static Dataset *alloc_dataset(const File_layout *layout, int num_items,
+                              size_t data_align, size_t data_len) {
+    size_t meta_len = sizeof(Dataset) + (sizeof(double) + sizeof(unsigned int) + 1) * num_items;
+    meta_len = ALIGN_UP(meta_len, data_align);
+
+    char *base = mmap(NULL, meta_len + data_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    Dataset *data = (Dataset *)base;
+    data->num_items = num_items;
+    data->sx = layout->sx;
+    data->sy = layout->sy;
+    data->num_pixels = layout->sx * layout->sy;
+    data->kernels = kernels_for_size(data->num_pixels);
+    data->norms = (double *)(data + 1);
+    data->sq_norms = (unsigned int *)(data->norms + num_items);
+    data->labels = (unsigned char *)(data->sq_norms + num_items);
+    data->pixels = (unsigned char *)base + meta_len;
+    data->map = base;
+    data->map_len = meta_len + data_len;
+    return data;
+}
+
+/**
+ * free() an array of `owner`, unless it lies in the owner's mapping, as the
+ * arrays of a dataset read from an index do (see map_index). A NULL owner
+ * owns no mapping.
+ */
+static void release(const Dataset *owner, void *ptr) {
+    if (owner != NULL && (char *)ptr >= (char *)owner->map &&
+        (char *)ptr < (char *)owner->map + owner->map_len) {
+        return;
+    }
+    free(ptr);
+}
+
+/* Fill in the euclidean norm of every image, once pixels are in place */
+static void compute_norms(Dataset *data) {
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        data->sq_norms[i] = data->kernels->dot(img.data, img.data, img.sx * img.sy);
+        data->norms[i] = sqrt(data->sq_norms[i]);
+    }
+}
 
 /****************************************************************************/
 /* For all the remaining functions, the images are of the same size.        */
 /* No need to perform checks to ensure this.                                */
 /****************************************************************************/
 /**
- * load_dataset takes the name of the binary file containing the data and
- * loads it into memory. The binary file format consists of the following:
+ * load_dataset takes the name of the binary file containing the data and
+ * loads it into memory. The binary file format consists of the following:
+ *
+ *     -   4 bytes : `N`: Number of images / labels in the file
+ *     -   1 byte  : Image 1 label
+ *     - 784 bytes : Image 1 data (WIDTHxWIDTH)
+ *          ...
+ *     -   1 byte  : Image N label
+ *     - 784 bytes : Image N data (WIDTHxWIDTH)
+ *
+ * Files of other image sizes start with a longer header instead, which
+ * names the geometry:
+ *
+ *     -   4 bytes : "KNNG"
+ *     -   4 bytes : Image width `sx`
+ *     -   4 bytes : Image height `sy`
+ *     -   4 bytes : `N`: Number of images / labels in the file
+ *
+ * followed by N records of one label byte and `sx * sy` pixel bytes. The
+ * kernels specialized for that size, if there are any, are picked here.
+ *
+ * The pixels are copied into one 64-byte aligned slab with every image
+ * padded with zeros to a multiple of 64 bytes, and the labels into a
+ * parallel array, so scans over the dataset are linear.
+ *
+ * An index file written by write_index is mapped instead (see map_index).
+ *
+ * If the filename does not exist then the function will return a NULL pointer.
+ */
+Dataset *load_dataset(const char *filename) {
+    Dataset *index = map_index(filename);
+    if (index != NULL) {
+        return index;
+    }
+    File_layout layout;
+    size_t file_len;
+    int fd = open_dataset(filename, &layout, &file_len);
+    if (fd == -1) {
+        return NULL;
+    }
+    unsigned char *file = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    madvise(file, file_len, MADV_SEQUENTIAL);
+
+    // Anonymous memory is zero filled, which takes care of the padding
+    size_t n = (size_t)layout.sx * layout.sy;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    Dataset *data = alloc_dataset(&layout, layout.num_items, CACHE_LINE,
+                                  layout.num_items * stride);
+    data->stride = stride;
+
+    unsigned char *record = file + layout.header_size;
+    for (int i = 0; i < layout.num_items; i++, record += layout.record_size) {
+        data->labels[i] = record[0];
+        memcpy(data->pixels + i * stride, record + 1, n);
+    }
+    if (munmap(file, file_len) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    compute_norms(data);
+    return data;
+}
+
+/**
+ * map_dataset is a zero-copy alternative to load_dataset. The file is mapped
+ * into memory and the dataset's pixels point straight into the mapping, with
+ * a stride of one on-disk record, so no per-image reads or allocations
+ * happen. The mapping is placed right after the region holding the Dataset
+ * struct and labels, which lets free_dataset release everything with a
+ * single munmap.
+ *
+ * If the filename does not exist then the function will return a NULL pointer.
+ */
+Dataset *map_dataset(const char *filename) {
+    return map_dataset_slice(filename, 0, INT_MAX);
+}
+
+/**
+ * Like map_dataset, but only maps the `count` records starting at image
+ * `start` (fewer if the file ends first). Records have a fixed size, so the
+ * slice is located directly and nothing outside of it is ever read.
+ *
+ * If the filename does not exist then the function will return a NULL pointer.
+ */
+Dataset *map_dataset_slice(const char *filename, int start, int count) {
+    File_layout layout;
+    size_t file_len;
+    int fd = open_dataset(filename, &layout, &file_len);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (start < 0 || start > layout.num_items) {
+        fprintf(stderr, "Error: %s has no image %d\n", filename, start);
+        exit(1);
+    }
+    if (count > layout.num_items - start) {
+        count = layout.num_items - start;
+    }
+
+    // mmap offsets must be page aligned, so map from the page holding the
+    // first record's label.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = layout.header_size + (size_t)start * layout.record_size;
+    size_t offset = first & ~(page - 1);
+    size_t map_len = count > 0 ? first - offset + (size_t)count * layout.record_size : 0;
+
+    // Reserve room for the metadata followed by the slice, then map the file
+    // over the tail of the reservation.
+    Dataset *data = alloc_dataset(&layout, count, page, map_len);
+    data->stride = layout.record_size;
+    unsigned char *records = NULL;  // First record of the slice, label first
+    if (map_len > 0) {
+        // Writable but private, so rearranging the pixels (prepare_training)
+        // never touches the file
+        unsigned char *file = mmap(data->pixels, map_len, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_FIXED, fd, offset);
+        if (file == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        // Every record is touched below to collect the labels, so ask the
+        // kernel to start reading ahead right away.
+        madvise(file, map_len, MADV_WILLNEED);
+        records = file + (first - offset);
+        data->pixels = records + 1;
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        data->labels[i] = records[(size_t)i * data->stride];
+    }
+    compute_norms(data);
+    return data;
+}
+
+/**
+ * Return the number of images stored in the dataset file `filename` by
+ * reading only its header, or -1 if the file does not exist.
+ */
+int dataset_size(const char *filename) {
+    File_layout layout;
+    size_t file_len;
+    int fd = open_dataset(filename, &layout, &file_len);
+    if (fd == -1) {
+        return -1;
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return layout.num_items;
+}
+
+/* Per-pixel statistics of a dataset, used to order pixels by variance */
+typedef struct {
+    int pixel;
+    double variance;
+    int blank;       // 1 if the pixel is zero in every image
+} Pixel_stat;
+
+/* Sort by decreasing variance, then blank pixels last, then by raster position */
+static int compare_pixel_stats(const void *a, const void *b) {
+    const Pixel_stat *x = a, *y = b;
+    if (x->variance != y->variance) {
+        return x->variance > y->variance ? -1 : 1;
+    }
+    if (x->blank != y->blank) {
+        return x->blank - y->blank;
+    }
+    return x->pixel - y->pixel;
+}
+
+/**
+ * Reorder the pixels of every image of `data` by decreasing variance across
+ * the dataset, remembering the order in `pixel_order`. The pixels that are
+ * blank in every image come last, and are no longer stored past the first
+ * multiple of CACHE_LINE pixels, so the images are repacked to a shorter
+ * stride.
+ */
+static void order_pixels_by_variance(Dataset *data) {
+    int n = data->sx * data->sy;
+
+    // Variances scaled by N^2, exact in 64-bit integers up to 66049 pixels
+    unsigned long long *sum = calloc(n, sizeof(unsigned long long));
+    unsigned long long *sum_sq = calloc(n, sizeof(unsigned long long));
+    Pixel_stat *stats = malloc(sizeof(Pixel_stat) * n);
+    data->pixel_order = malloc(sizeof(int) * n);
+    unsigned char *tmp = malloc(n);
+    if (sum == NULL || sum_sq == NULL || stats == NULL ||
+        data->pixel_order == NULL || tmp == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        for (int p = 0; p < n; p++) {
+            sum[p] += img.data[p];
+            sum_sq[p] += img.data[p] * img.data[p];
+        }
+    }
+    int kept = 0;
+    for (int p = 0; p < n; p++) {
+        stats[p].pixel = p;
+        stats[p].variance = (double)(data->num_items * sum_sq[p] - sum[p] * sum[p]);
+        stats[p].blank = sum[p] == 0;
+        kept += sum[p] != 0;
+    }
+    qsort(stats, n, sizeof(Pixel_stat), compare_pixel_stats);
+    for (int p = 0; p < n; p++) {
+        data->pixel_order[p] = stats[p].pixel;
+    }
+
+    // Image i moves to i * stride, never past where it was, and is read
+    // whole into `tmp` before being written
+    // Sizes with specialized kernels keep every pixel, the blank ones last
+    // as zero padding, since the kernels' fixed trip counts only hold there
+    if (kernels_for_size(n)->pixels == n) {
+        data->num_pixels = n;
+    } else {
+        data->num_pixels = ALIGN_UP(kept, CACHE_LINE) < (size_t)n ? ALIGN_UP(kept, CACHE_LINE) : n;
+    }
+    data->kernels = kernels_for_size(data->num_pixels);
+    int stride = ALIGN_UP(data->num_pixels, CACHE_LINE);
+    img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        for (int p = 0; p < n; p++) {
+            tmp[p] = img.data[data->pixel_order[p]];
+        }
+        unsigned char *packed = data->pixels + (size_t)i * stride;
+        memcpy(packed, tmp, data->num_pixels);
+        memset(packed + data->num_pixels, 0, stride - data->num_pixels);
+    }
+    data->stride = stride;
+
+    free(sum);
+    free(sum_sq);
+    free(stats);
+    free(tmp);
+}
+
+/**
+ * prepare_training readies a training set, once after loading it, for
+ * searches under `metric`:
+ *
+ *   - The pixels of every image are reordered by decreasing variance across
+ *     the dataset. The early-abandoning distances then sum the most
+ *     discriminative pixels first and give up sooner, instead of starting
+ *     with border pixels that are blank in almost every image.
+ *   - Pixels blank in every image, such as most of the border of digits,
+ *     are then dropped, and only the first `num_pixels` are stored, unless
+ *     the image size has specialized kernels (see kernels_for_size). A
+ *     query's pixels there add the same amount to its distance to every
+ *     image, which the search adds back exactly, and nothing to dot
+ *     products.
+ *   - The metric's precompute hook, if it has one, runs on the result. The
+ *     euclidean and manhattan metrics sum blocks of pixels there, by raster
+ *     position, which lets the search skip most images (see
+ *     prepare_block_sums). The euclidean and cosine metrics also list the
+ *     nonzero pixels of each image there when images are mostly blank (see
+ *     prepare_sparse).
+ *
+ * knn_predict rearranges each query the same way, so metrics must treat
+ * pixels independently of their position (as the euclidean and cosine
+ * distances do). Images read back with dataset_image() are in the
+ * rearranged order, and only their first `num_pixels` pixels are stored.
+ */
+void prepare_training(Dataset *data, const Metric *metric) {
+    if (data->num_items == 0) {
+        return;
+    }
+    if (data->pixel_order == NULL) {
+        order_pixels_by_variance(data);
+    }
+    if (metric->prepare != NULL) {
+        metric->prepare(data);
+    }
+}
+
+/**
+ * Sum the 4x4 pixel blocks of one image of `n` pixels into `sums`, whose
+ * padding is left zero. Pixel p of `pixels` is at raster position order[p],
+ * or at p if `order` is NULL.
+ */
+static void block_sums(const Dataset *data, const unsigned char *pixels, const int *order,
+                       int n, unsigned short *sums) {
+    memset(sums, 0, sizeof(unsigned short) * data->sums_stride);
+    for (int p = 0; p < n; p++) {
+        int r = order != NULL ? order[p] : p;
+        sums[r / data->sx / 4 * (data->sx / 4) + r % data->sx / 4] += pixels[p];
+    }
+}
+
+/**
+ * Precompute hook of the euclidean and manhattan metrics: the sums of every
+ * 4x4 pixel block of each image, a 7x7 image for 28x28 digits. Over a block
+ * of 16 pixels whose sums differ by D, Cauchy-Schwarz gives
+ * sum((a - b)^2) >= D^2 / 16 and the triangle inequality
+ * sum(|a - b|) >= |D|, so 49 block sums bound the distance from below.
+ * Images whose sides are not multiples of 4 get no block sums.
+ */
+static void prepare_block_sums(Dataset *data) {
+    if (data->block_sums != NULL || data->sx % 4 != 0 || data->sy % 4 != 0) {
+        return;
+    }
+    data->sums_stride = ALIGN_UP(data->sx / 4 * (data->sy / 4), SUMS_ALIGN);
+    data->block_sums = malloc(sizeof(unsigned short) * data->sums_stride * data->num_items);
+    if (data->block_sums == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        block_sums(data, img.data, data->pixel_order, data->num_pixels,
+                   data->block_sums + (size_t)i * data->sums_stride);
+    }
+}
+
+/**
+ * Precompute hook of the cosine metric, and of the euclidean one through
+ * prepare_euclidean: list the nonzero pixels of every image, as their
+ * stored positions and values, when the measured fraction of nonzero pixels
+ * is low enough for a sparse kernel to beat its dense counterpart. Dot
+ * products then only visit those positions of the query, and the euclidean
+ * key follows from |a - b|^2 = |a|^2 + |b|^2 - 2 a.b. Denser datasets, and
+ * images of more pixels than 16-bit positions can index, stay dense only.
+ *
+ * The searches check the density against the kernels' crossover points
+ * separately (see uses_sparse and uses_sparse_block), as gathering pixels of
+ * one query and multiplying rows of a block of queries pay off at different
+ * densities.
+ */
+static void prepare_sparse(Dataset *data) {
+    int n = data->num_pixels;
+    if (data->sparse_start != NULL || n > USHRT_MAX + 1) {
+        return;
+    }
+    size_t nnz = 0;
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        for (int p = 0; p < n; p++) {
+            nnz += img.data[p] != 0;
+        }
+    }
+    float density = (double)nnz / n / data->num_items;
+    if (density >= data->kernels->sparse_density &&
+        density >= data->kernels->sparse_block_density) {
+        return;
+    }
+    data->density = density;
+
+    data->sparse_start = malloc(sizeof(size_t) * (data->num_items + 1));
+    data->sparse_index = malloc(sizeof(unsigned short) * nnz);
+    data->sparse_values = malloc(nnz);
+    if (data->sparse_start == NULL || data->sparse_index == NULL ||
+        data->sparse_values == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t k = 0;
+    img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        data->sparse_start[i] = k;
+        for (int p = 0; p < n; p++) {
+            if (img.data[p] != 0) {
+                data->sparse_index[k] = p;
+                data->sparse_values[k++] = img.data[p];
+            }
+        }
+    }
+    data->sparse_start[data->num_items] = k;
+}
+
+/* Precompute hook of the euclidean metric */
+static void prepare_euclidean(Dataset *data) {
+    prepare_block_sums(data);
+    prepare_sparse(data);
+}
+
+/**
+ * transpose_training adds a pixel-major copy of a training set, which lets
+ * knn_predict score COLUMN_BLOCK images per kernel call for the euclidean
+ * distance. The images are grouped in blocks of COLUMN_BLOCK, and row p of a
+ * block holds pixel p of each of its images, so one broadcast query pixel is
+ * compared against the whole row at once, with no per-image call and no
+ * horizontal sum. Images past the end of the last block are blank.
+ *
+ * The copy is in the stored pixel order, so call it after prepare_training.
+ * It takes as much memory again as the pixels.
+ */
+void transpose_training(Dataset *data) {
+    int n = data->num_pixels;
+    if (data->num_items == 0 || data->columns != NULL) {
+        return;
+    }
+    int blocks = (data->num_items + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+    size_t len = (size_t)blocks * n * COLUMN_BLOCK;
+    if (posix_memalign((void **)&data->columns, CACHE_LINE, len) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(data->columns, 0, len);
+
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        // Block i / COLUMN_BLOCK starts at row (i / COLUMN_BLOCK) * n
+        unsigned char *col = data->columns + (size_t)(i - i % COLUMN_BLOCK) * n + i % COLUMN_BLOCK;
+        for (int p = 0; p < n; p++) {
+            col[(size_t)p * COLUMN_BLOCK] = img.data[p];
+        }
+    }
+}
+
+/* Set bit p of `bits` if pixel p is at least BINARY_THRESHOLD */
+static void binarize(const unsigned char *pixels, int n, unsigned long long *bits) {
+    memset(bits, 0, sizeof(unsigned long long) * ((n + 63) / 64));
+    for (int p = 0; p < n; p++) {
+        if (pixels[p] >= BINARY_THRESHOLD) {
+            bits[p / 64] |= 1ULL << (p % 64);
+        }
+    }
+}
+
+/**
+ * binarize_training adds a 1-bit copy of a training set, with every pixel
+ * set if it is at least BINARY_THRESHOLD: 104 bytes per 28x28 image instead
+ * of 784, which loses little on digits that are nearly black and white.
+ * knn_predict then first shortlists the K * `multiplier` images closest to
+ * the binarized query in Hamming distance (XOR and popcount), and ranks only
+ * those under the metric. True neighbors left out of the shortlist are
+ * missed, so the search is no longer exact; a multiplier of 0 turns the
+ * shortlist off again.
+ *
+ * The copy is in the stored pixel order, so call it after prepare_training.
+ */
+void binarize_training(Dataset *data, int multiplier) {
+    int n = data->num_pixels;
+    data->shortlist = multiplier;
+    if (data->num_items == 0 || data->bits != NULL) {
+        return;
+    }
+    data->bits_stride = (n + 63) / 64;
+    if (posix_memalign((void **)&data->bits, CACHE_LINE, sizeof(unsigned long long) *
+                       data->bits_stride * data->num_items) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        binarize(img.data, n, data->bits + (size_t)i * data->bits_stride);
+    }
+}
+
+static Projection *alloc_projection(int pixels, int components) {
+    Projection *pca = malloc(sizeof(Projection));
+    if (pca == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pca->pixels = pixels;
+    pca->components = components;
+    pca->dims = ALIGN_UP(components, FLOAT_ALIGN);
+    pca->offset = calloc(pca->dims, sizeof(float));
+    pca->axes = calloc((size_t)pixels * pca->dims, sizeof(float));
+    if (pca->offset == NULL || pca->axes == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return pca;
+}
+
+/* Free `pca`, whose arrays may lie in the mapping of `owner` (see release) */
+static void free_projection(const Dataset *owner, Projection *pca) {
+    if (pca == NULL) {
+        return;
+    }
+    release(owner, pca->offset);
+    release(owner, pca->axes);
+    free(pca);
+}
+
+/* Project one image, in the training set's pixel order, into `out` */
+static void project_image(const Projection *pca, const unsigned char *pixels, float *out) {
+    for (int c = 0; c < pca->dims; c++) {
+        out[c] = -pca->offset[c];
+    }
+    // Digits are mostly blank, so only lit pixels are worth a row of axes
+    for (int p = 0; p < pca->pixels; p++) {
+        if (pixels[p] != 0) {
+            const float *axis = pca->axes + (size_t)p * pca->dims;
+            float x = pixels[p];
+            for (int c = 0; c < pca->dims; c++) {
+                out[c] += x * axis[c];
+            }
+        }
+    }
+}
+
+/**
+ * Make the `k` columns of the row-major n x k matrix `m` orthonormal with
+ * modified Gram-Schmidt. Columns that are dependent on the previous ones
+ * are zeroed.
+ */
+static void orthonormalize(double *m, int n, int k) {
+    for (int c = 0; c < k; c++) {
+        for (int prev = 0; prev < c; prev++) {
+            double dot = 0;
+            for (int i = 0; i < n; i++) {
+                dot += m[(size_t)i * k + c] * m[(size_t)i * k + prev];
+            }
+            for (int i = 0; i < n; i++) {
+                m[(size_t)i * k + c] -= dot * m[(size_t)i * k + prev];
+            }
+        }
+        double norm = 0;
+        for (int i = 0; i < n; i++) {
+            norm += m[(size_t)i * k + c] * m[(size_t)i * k + c];
+        }
+        norm = sqrt(norm);
+        for (int i = 0; i < n; i++) {
+            m[(size_t)i * k + c] = norm > 1e-9 ? m[(size_t)i * k + c] / norm : 0;
+        }
+    }
+}
+
+/**
+ * Fit the first `components` principal axes of the images of `data`. The
+ * covariance matrix is summed exactly in integers over at most PCA_SAMPLE
+ * images, one lit pixel pair at a time, and the axes come out of subspace
+ * iteration: a fixed pseudo-random basis is multiplied by the covariance
+ * and orthonormalized again, PCA_ROUNDS times. Any orthonormal basis of
+ * nearly the leading subspace serves for the shortlist, so the axes are
+ * not rotated into individual eigenvectors.
+ */
+static Projection *fit_projection(const Dataset *data, int components) {
+    int n = data->num_pixels;
+    int k = components;
+    int step = (data->num_items + PCA_SAMPLE - 1) / PCA_SAMPLE;
+
+    // Sums of pixels and of products of pixel pairs p <= q over the sample
+    unsigned long long *sum = calloc(n, sizeof(unsigned long long));
+    unsigned long long *prod = calloc((size_t)n * n, sizeof(unsigned long long));
+    int *lit = malloc(sizeof(int) * n);
+    if (sum == NULL || prod == NULL || lit == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = 0;
+    for (int i = 0; i < data->num_items; i += step, count++) {
+        const unsigned char *x = data->pixels + (size_t)i * data->stride;
+        int num_lit = 0;
+        for (int p = 0; p < n; p++) {
+            sum[p] += x[p];
+            if (x[p] != 0) {
+                lit[num_lit++] = p;
+            }
+        }
+        for (int a = 0; a < num_lit; a++) {
+            unsigned long long *row = prod + (size_t)lit[a] * n;
+            unsigned int xa = x[lit[a]];
+            for (int b = a; b < num_lit; b++) {
+                row[lit[b]] += xa * x[lit[b]];
+            }
+        }
+    }
+
+    double *cov = malloc(sizeof(double) * n * n);
+    double *mean = malloc(sizeof(double) * n);
+    double *basis = malloc(sizeof(double) * n * k);
+    double *next = malloc(sizeof(double) * n * k);
+    if (cov == NULL || mean == NULL || basis == NULL || next == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int p = 0; p < n; p++) {
+        mean[p] = (double)sum[p] / count;
+    }
+    for (int p = 0; p < n; p++) {
+        for (int q = p; q < n; q++) {
+            double c = (double)prod[(size_t)p * n + q] / count - mean[p] * mean[q];
+            cov[(size_t)p * n + q] = c;
+            cov[(size_t)q * n + p] = c;
+        }
+    }
+    free(sum);
+    free(prod);
+    free(lit);
+
+    unsigned int seed = 1;
+    for (size_t i = 0; i < (size_t)n * k; i++) {
+        seed = seed * 1103515245 + 12345;
+        basis[i] = (double)(seed >> 8) / (1 << 24) - 0.5;
+    }
+    orthonormalize(basis, n, k);
+    for (int round = 0; round < PCA_ROUNDS; round++) {
+        memset(next, 0, sizeof(double) * n * k);
+        for (int p = 0; p < n; p++) {
+            double *out = next + (size_t)p * k;
+            for (int q = 0; q < n; q++) {
+                double c = cov[(size_t)p * n + q];
+                if (c == 0) {
+                    continue;
+                }
+                const double *in = basis + (size_t)q * k;
+                for (int j = 0; j < k; j++) {
+                    out[j] += c * in[j];
+                }
+            }
+        }
+        orthonormalize(next, n, k);
+        double *tmp = basis;
+        basis = next;
+        next = tmp;
+    }
+
+    Projection *pca = alloc_projection(n, components);
+    for (int p = 0; p < n; p++) {
+        for (int j = 0; j < k; j++) {
+            pca->axes[(size_t)p * pca->dims + j] = basis[(size_t)p * k + j];
+            pca->offset[j] += mean[p] * basis[(size_t)p * k + j];
+        }
+    }
+    free(cov);
+    free(mean);
+    free(basis);
+    free(next);
+    return pca;
+}
+
+/*
+ * FNV-1a hash of the images of `data` in their stored order, which ties a
+ * saved projection to the training set (and pixel order) it was fitted to
+ */
+static unsigned long long hash_images(const Dataset *data) {
+    int n = data->num_pixels;
+    unsigned long long h = 14695981039346656037ULL ^ data->num_items;
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        for (int p = 0; p < n; p++) {
+            h = (h ^ img.data[p]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+/**
+ * Read the projection saved in `path`, or return NULL if there is none or it
+ * was fitted to other images or to another number of components.
+ */
+static Projection *load_projection(const char *path, int pixels, int components,
+                                   unsigned long long hash) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    Projection_header header;
+    Projection *pca = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, PROJECTION_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == PROJECTION_VERSION && header.pixels == pixels &&
+        header.components == components && header.hash == hash) {
+        pca = alloc_projection(pixels, components);
+        size_t axes_len = (size_t)pixels * pca->dims;
+        if (fread(pca->offset, sizeof(float), pca->dims, file) != pca->dims ||
+            fread(pca->axes, sizeof(float), axes_len, file) != axes_len) {
+            free_projection(NULL, pca);
+            pca = NULL;
+        }
+    }
+    if (fclose(file) == EOF) {
+        perror("fclose");
+        exit(1);
+    }
+    return pca;
+}
+
+/**
+ * Save `pca` to `path` for load_projection. The file is only a cache, so
+ * failing to write it is reported but not fatal.
+ */
+static void save_projection(const char *path, const Projection *pca, int components,
+                            unsigned long long hash) {
+    Projection_header header = {PROJECTION_MAGIC, PROJECTION_VERSION, pca->pixels,
+                                components, hash};
+    size_t axes_len = (size_t)pca->pixels * pca->dims;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(pca->offset, sizeof(float), pca->dims, file) != pca->dims ||
+        fwrite(pca->axes, sizeof(float), axes_len, file) != axes_len ||
+        fclose(file) == EOF) {
+        fprintf(stderr, "Warning: could not save the projection to %s\n", path);
+        remove(path);
+    }
+}
+
+/**
+ * project_training fits PCA to a training set and adds a copy of every
+ * image projected onto its first `components` principal axes, as floats:
+ * 32 to 64 components keep most of the variance of 28x28 digits at a small
+ * fraction of the size. knn_predict then projects the query once,
+ * shortlists the K * `multiplier` images nearest to it in the projected
+ * space, and ranks only those under the metric, like the Hamming shortlist
+ * (see binarize_training), which it replaces. Neighbors left out of the
+ * shortlist are missed, so the search is approximate.
+ *
+ * Fitting takes a while, so if `cache_file` is not NULL the projection is
+ * saved there, and later runs read it back instead, as long as the file
+ * was saved for the same images and number of components.
+ *
+ * A projection read from an index (see map_index) is kept, with the new
+ * multiplier, and asking for another number of components is an error.
+ *
+ * The projection is in the stored pixel order, so call it after
+ * prepare_training.
+ */
+void project_training(Dataset *data, int components, int multiplier, const char *cache_file) {
+    int n = data->num_pixels;
+    data->shortlist = multiplier;
+    if (data->num_items == 0) {
+        return;
+    }
+    if (data->projected != NULL) {
+        if (components != data->projection->components) {
+            fprintf(stderr, "Error: the training set is already projected onto %d components\n",
+                    data->projection->components);
+            exit(1);
+        }
+        return;
+    }
+    if (n > PCA_MAX_PIXELS) {
+        fprintf(stderr, "Error: PCA only supports images of up to %d pixels\n", PCA_MAX_PIXELS);
+        exit(1);
+    }
+    if (components < 1 || components > n) {
+        fprintf(stderr, "Error: expected 1 to %d PCA components\n", n);
+        exit(1);
+    }
+    unsigned long long hash = hash_images(data);
+    Projection *pca = cache_file != NULL ? load_projection(cache_file, n, components, hash) : NULL;
+    if (pca == NULL) {
+        pca = fit_projection(data, components);
+        if (cache_file != NULL) {
+            save_projection(cache_file, pca, components, hash);
+        }
+    }
+    data->projection = pca;
+    if (posix_memalign((void **)&data->projected, CACHE_LINE,
+                       sizeof(float) * pca->dims * data->num_items) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    Image img = dataset_image(data, 0);
+    for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+        project_image(pca, img.data, data->projected + (size_t)i * pca->dims);
+    }
+}
+
+/* An image and its norm, or its distance to a vantage point, to sort images by */
+typedef struct {
+    double norm;
+    int idx;
+} Image_norm;
+
+/* Sort by increasing norm, then by index */
+static int compare_image_norms(const void *a, const void *b) {
+    const Image_norm *x = a, *y = b;
+    if (x->norm != y->norm) {
+        return x->norm < y->norm ? -1 : 1;
+    }
+    return x->idx - y->idx;
+}
+
+/**
+ * Return a copy of `data` holding image order[j] as image j, with its block
+ * sums and pivot distances but no other copies, for searches that visit the
+ * images in that order.
+ */
+static Dataset *reordered_copy(const Dataset *data, const int *order) {
+    int n = data->num_pixels;
+    File_layout layout = {data->num_items, data->sx, data->sy, 0, 0};
+    Dataset *copy = alloc_dataset(&layout, data->num_items, CACHE_LINE,
+                                  data->num_items * ALIGN_UP(n, CACHE_LINE));
+    copy->stride = ALIGN_UP(n, CACHE_LINE);
+    copy->num_pixels = n;
+    copy->kernels = data->kernels;
+    if (data->block_sums != NULL) {
+        copy->sums_stride = data->sums_stride;
+        copy->block_sums = malloc(sizeof(unsigned short) * data->sums_stride * data->num_items);
+        if (copy->block_sums == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    if (data->pivot_dists != NULL) {
+        copy->pivot_stride = data->pivot_stride;
+        copy->pivot_dists = malloc(sizeof(float) * data->pivot_stride * data->num_items);
+        if (copy->pivot_dists == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    for (int j = 0; j < data->num_items; j++) {
+        int i = order[j];
+        copy->labels[j] = data->labels[i];
+        copy->norms[j] = data->norms[i];
+        copy->sq_norms[j] = data->sq_norms[i];
+        memcpy(copy->pixels + (size_t)j * copy->stride,
+               data->pixels + (size_t)i * data->stride, n);
+        if (data->block_sums != NULL) {
+            memcpy(copy->block_sums + (size_t)j * data->sums_stride,
+                   data->block_sums + (size_t)i * data->sums_stride,
+                   sizeof(unsigned short) * data->sums_stride);
+        }
+        if (data->pivot_dists != NULL) {
+            memcpy(copy->pivot_dists + (size_t)j * data->pivot_stride,
+                   data->pivot_dists + (size_t)i * data->pivot_stride,
+                   sizeof(float) * data->pivot_stride);
+        }
+    }
+    return copy;
+}
+
+/**
+ * order_training_by_norm adds a copy of a training set with its images
+ * sorted by increasing euclidean norm. Since |a - b| >= |norm(a) - norm(b)|,
+ * knn_predict can then scan the copy outward from the query's norm, a block
+ * of images at a time in both directions, for metrics with a norm bound
+ * (euclidean and manhattan), and stop as soon as the norm gap alone rules
+ * out every image left. The search stays exact, and neighbors are still
+ * reported and tie-broken by their index in the original order.
+ *
+ * It only pays off when norms spread widely compared to the distances
+ * between neighbors, as with images of very different brightness. For
+ * digits, nearly every image lies within the K-th distance in norm and
+ * almost nothing is pruned, so the classifier leaves it off unless asked.
+ *
+ * The copy takes as much memory again as the pixels, and keeps the block
+ * sums and the pivot table (see pivot_training) but no other copies, so
+ * call it after prepare_training and pivot_training.
+ */
+void order_training_by_norm(Dataset *data) {
+    if (data->num_items == 0 || data->by_norm != NULL) {
+        return;
+    }
+    Image_norm *ranks = malloc(sizeof(Image_norm) * data->num_items);
+    data->norm_order = malloc(sizeof(int) * data->num_items);
+    if (ranks == NULL || data->norm_order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        ranks[i].norm = data->norms[i];
+        ranks[i].idx = i;
+    }
+    qsort(ranks, data->num_items, sizeof(Image_norm), compare_image_norms);
+    for (int j = 0; j < data->num_items; j++) {
+        data->norm_order[j] = ranks[j].idx;
+    }
+    data->by_norm = reordered_copy(data, data->norm_order);
+    free(ranks);
+}
+
+/**
+ * pivot_training builds a pivot table (as in LAESA) over a training set: the
+ * euclidean distances from every image to `num_pivots` pivot images. The
+ * pivots are picked by farthest-point selection, each one the image
+ * farthest from all the previous ones, starting from the first image, so
+ * they spread over the dataset.
+ *
+ * Since |a - b| >= |d(a, p) - d(b, p)| for any pivot p, knn_predict computes
+ * the query's distances to the pivots once, and then skips images whose
+ * largest pivot gap already rules them out without touching their pixels.
+ * The search stays exact, for the manhattan distance too, which is never
+ * below the euclidean one.
+ *
+ * A pivot table read from an index (see map_index) is kept, and asking for
+ * another number of pivots is an error. Call it after prepare_training.
+ */
+void pivot_training(Dataset *data, int num_pivots) {
+    int n = data->num_pixels;
+    if (data->num_items == 0) {
+        return;
+    }
+    if (data->pivots != NULL) {
+        if (num_pivots != data->num_pivots) {
+            fprintf(stderr, "Error: the training set already has %d pivots\n", data->num_pivots);
+            exit(1);
+        }
+        return;
+    }
+    if (num_pivots < 1 || num_pivots > data->num_items) {
+        fprintf(stderr, "Error: expected 1 to %d pivots\n", data->num_items);
+        exit(1);
+    }
+    data->num_pivots = num_pivots;
+    data->pivot_stride = ALIGN_UP(num_pivots, FLOAT_ALIGN);
+    data->pivots = malloc(sizeof(int) * num_pivots);
+    data->pivot_dists = calloc((size_t)data->pivot_stride * data->num_items, sizeof(float));
+    float *nearest = malloc(sizeof(float) * data->num_items);
+    if (data->pivots == NULL || data->pivot_dists == NULL || nearest == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        nearest[i] = INFINITY;
+    }
+
+    int next = 0;
+    for (int p = 0; p < num_pivots; p++) {
+        data->pivots[p] = next;
+        const unsigned char *pivot = data->pixels + (size_t)next * data->stride;
+        Image img = dataset_image(data, 0);
+        for (int i = 0; i < data->num_items; i++, img.data += data->stride) {
+            float d = sqrt(data->kernels->sq_diff(img.data, pivot, n));
+            data->pivot_dists[(size_t)i * data->pivot_stride + p] = d;
+            if (d < nearest[i]) {
+                nearest[i] = d;
+            }
+        }
+        // The next pivot is the image farthest from all pivots so far
+        for (int i = 0; i < data->num_items; i++) {
+            if (nearest[i] > nearest[next]) {
+                next = i;
+            }
+        }
+    }
+    free(nearest);
+}
+
+/* Free `tree`, whose arrays may lie in the mapping of `owner` (see release) */
+static void free_vp_tree(const Dataset *owner, Vp_tree *tree) {
+    if (tree != NULL) {
+        release(owner, tree->order);
+        release(owner, tree->bounds);
+        free_dataset(tree->images);
+        free(tree);
+    }
+}
+
+static Vp_tree *alloc_vp_tree(int num_items) {
+    Vp_tree *tree = malloc(sizeof(Vp_tree));
+    if (tree == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    tree->order = malloc(sizeof(int) * num_items);
+    tree->bounds = malloc(sizeof(float) * 4 * num_items);
+    tree->images = NULL;
+    if (tree->order == NULL || tree->bounds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return tree;
+}
+
+/**
+ * Build the subtree of `tree` at positions lo to hi - 1, whose images are
+ * already in tree->order. The vantage point is the image farthest from the
+ * first one of the subtree, as points near the edge of the data split it
+ * into tighter shells than central ones. `ranks` is scratch with an entry
+ * per position.
+ */
+static void build_vp_subtree(const Dataset *data, Vp_tree *tree, Image_norm *ranks,
+                             int lo, int hi) {
+    if (hi - lo <= VP_LEAF) {
+        return;
+    }
+    int n = data->num_pixels;
+    int *order = tree->order;
+    const unsigned char *first = data->pixels + (size_t)order[lo] * data->stride;
+    int far = lo;
+    unsigned int farthest = 0;
+    for (int j = lo + 1; j < hi; j++) {
+        unsigned int d = data->kernels->sq_diff(data->pixels + (size_t)order[j] * data->stride,
+                                                first, n);
+        if (d > farthest) {
+            farthest = d;
+            far = j;
+        }
+    }
+    int vantage = order[far];
+    order[far] = order[lo];
+    order[lo] = vantage;
+
+    const unsigned char *pixels = data->pixels + (size_t)vantage * data->stride;
+    for (int j = lo + 1; j < hi; j++) {
+        ranks[j].norm = sqrt(data->kernels->sq_diff(
+            data->pixels + (size_t)order[j] * data->stride, pixels, n));
+        ranks[j].idx = order[j];
+    }
+    qsort(ranks + lo + 1, hi - lo - 1, sizeof(Image_norm), compare_image_norms);
+    for (int j = lo + 1; j < hi; j++) {
+        order[j] = ranks[j].idx;
+    }
+    int mid = lo + 1 + (hi - lo - 1) / 2;
+    float *bounds = tree->bounds + (size_t)4 * lo;
+    bounds[0] = ranks[lo + 1].norm;
+    bounds[1] = ranks[mid - 1].norm;
+    bounds[2] = ranks[mid].norm;
+    bounds[3] = ranks[hi - 1].norm;
+    build_vp_subtree(data, tree, ranks, lo + 1, mid);
+    build_vp_subtree(data, tree, ranks, mid, hi);
+}
+
+/**
+ * Read the vantage-point tree saved in `path`, or return NULL if there is
+ * none or it was built over other images.
+ */
+static Vp_tree *load_vp_tree(const char *path, int num_items, unsigned long long hash) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    Vp_tree_header header;
+    Vp_tree *tree = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, VP_TREE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == VP_TREE_VERSION && header.num_items == num_items &&
+        header.leaf == VP_LEAF && header.hash == hash) {
+        tree = alloc_vp_tree(num_items);
+        int valid = fread(tree->order, sizeof(int), num_items, file) == num_items &&
+                    fread(tree->bounds, sizeof(float), (size_t)4 * num_items, file) ==
+                        (size_t)4 * num_items;
+        for (int j = 0; valid && j < num_items; j++) {
+            valid = tree->order[j] >= 0 && tree->order[j] < num_items;
+        }
+        if (!valid) {
+            free_vp_tree(NULL, tree);
+            tree = NULL;
+        }
+    }
+    if (fclose(file) == EOF) {
+        perror("fclose");
+        exit(1);
+    }
+    return tree;
+}
+
+/**
+ * Save `tree` to `path` for load_vp_tree. Like a saved projection, the file
+ * is only a cache, so failing to write it is reported but not fatal.
+ */
+static void save_vp_tree(const char *path, const Vp_tree *tree, int num_items,
+                         unsigned long long hash) {
+    Vp_tree_header header = {VP_TREE_MAGIC, VP_TREE_VERSION, num_items, VP_LEAF, hash};
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(tree->order, sizeof(int), num_items, file) != num_items ||
+        fwrite(tree->bounds, sizeof(float), (size_t)4 * num_items, file) !=
+            (size_t)4 * num_items ||
+        fclose(file) == EOF) {
+        fprintf(stderr, "Warning: could not save the vantage-point tree to %s\n", path);
+        remove(path);
+    }
+}
+
+/**
+ * vp_tree_training builds a vantage-point tree over a training set. Every
+ * node splits its images at the median of their euclidean distances to a
+ * vantage image, and keeps the range of distances on each side. Since
+ * |a - b| >= |d(a, v) - d(b, v)|, knn_predict can then skip a whole subtree
+ * whose range is far enough from the query's distance to v, for metrics
+ * with a norm bound (euclidean and manhattan), the same way as the search
+ * by norm (see order_training_by_norm) stops early. The search visits the
+ * nearer side first so the bound tightens early, and stays exact.
+ *
+ * Like the search by norm, it hardly prunes anything on digits, whose
+ * distances to any vantage point spread little compared to the distances
+ * between neighbors, so the classifier leaves it off unless asked. It pays
+ * off on data of lower intrinsic dimension.
+ *
+ * Building takes about 2 log2(N / VP_LEAF) distances per image, so if
+ * `cache_file` is not NULL the tree is saved there, and later runs read it
+ * back instead as long as it was built over the same images. The images
+ * are then copied in tree order, so that every leaf is scored as one block,
+ * with the same memory cost and the same rules as the copy sorted by norm:
+ * call it after prepare_training and pivot_training. It takes precedence
+ * over order_training_by_norm. A tree read from an index (see map_index)
+ * is kept.
+ */
+void vp_tree_training(Dataset *data, const char *cache_file) {
+    if (data->num_items == 0 || data->vp_tree != NULL) {
+        return;
+    }
+    unsigned long long hash = hash_images(data);
+    Vp_tree *tree = cache_file != NULL ? load_vp_tree(cache_file, data->num_items, hash) : NULL;
+    if (tree == NULL) {
+        tree = alloc_vp_tree(data->num_items);
+        Image_norm *ranks = malloc(sizeof(Image_norm) * data->num_items);
+        if (ranks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < data->num_items; i++) {
+            tree->order[i] = i;
+        }
+        memset(tree->bounds, 0, sizeof(float) * 4 * data->num_items);
+        build_vp_subtree(data, tree, ranks, 0, data->num_items);
+        free(ranks);
+        if (cache_file != NULL) {
+            save_vp_tree(cache_file, tree, data->num_items, hash);
+        }
+    }
+    tree->images = reordered_copy(data, tree->order);
+    data->vp_tree = tree;
+}
+
+/* Free `ivf`, whose arrays may lie in the mapping of `owner` (see release) */
+static void free_ivf(const Dataset *owner, Ivf *ivf) {
+    if (ivf != NULL) {
+        release(owner, ivf->centroids);
+        release(owner, ivf->codebooks);
+        release(owner, ivf->cell_terms);
+        release(owner, ivf->cell_start);
+        release(owner, ivf->ids);
+        release(owner, ivf->codes);
+        free(ivf);
+    }
+}
+
+/* Subspaces of the codes of images of `pixels` pixels, padded for pq_scan */
+static int ivf_subspaces(int pixels) {
+    return ALIGN_UP((pixels + PQ_DIMS - 1) / PQ_DIMS, PQ_SUBSPACE_ALIGN);
+}
+
+/* Return the cell of `ivf` whose centroid is nearest to `pixels` */
+static int nearest_cell(const Dataset *data, const Ivf *ivf, const unsigned char *pixels) {
+    int n = data->num_pixels;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    int best = 0;
+    unsigned int best_dist = UINT_MAX;
+    for (int c = 0; c < ivf->num_cells; c++) {
+        unsigned int d = data->kernels->sq_diff_bounded(ivf->centroids + c * stride, pixels, n,
+                                                        best_dist);
+        if (d < best_dist) {
+            best_dist = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+/**
+ * Fit the cells of `ivf` by k-means, starting from images spread over the
+ * training set, and store the cell of every image in `cell`. Centroids are
+ * rounded to bytes, so that the pixel kernels measure distances to them.
+ */
+static void fit_cells(const Dataset *data, Ivf *ivf, int *cell) {
+    int n = data->num_pixels;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    int step = (data->num_items + IVF_SAMPLE - 1) / IVF_SAMPLE;
+    ivf->centroids = calloc((size_t)ivf->num_cells * stride, 1);
+    unsigned long long *sums = malloc(sizeof(unsigned long long) * ivf->num_cells * n);
+    int *counts = malloc(sizeof(int) * ivf->num_cells);
+    if (ivf->centroids == NULL || sums == NULL || counts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int c = 0; c < ivf->num_cells; c++) {
+        memcpy(ivf->centroids + c * stride,
+               data->pixels + (size_t)c * data->num_items / ivf->num_cells * data->stride, n);
+    }
+    for (int round = 0; round < IVF_ROUNDS; round++) {
+        memset(sums, 0, sizeof(unsigned long long) * ivf->num_cells * n);
+        memset(counts, 0, sizeof(int) * ivf->num_cells);
+        for (int i = 0; i < data->num_items; i += step) {
+            const unsigned char *x = data->pixels + (size_t)i * data->stride;
+            int c = nearest_cell(data, ivf, x);
+            counts[c]++;
+            for (int p = 0; p < n; p++) {
+                sums[(size_t)c * n + p] += x[p];
+            }
+        }
+        // Cells left empty keep their centroid
+        for (int c = 0; c < ivf->num_cells; c++) {
+            for (int p = 0; counts[c] > 0 && p < n; p++) {
+                ivf->centroids[c * stride + p] = (sums[(size_t)c * n + p] + counts[c] / 2) / counts[c];
+            }
+        }
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        cell[i] = nearest_cell(data, ivf, data->pixels + (size_t)i * data->stride);
+    }
+    free(sums);
+    free(counts);
+}
+
+/* Subspace s of `pixels` as floats, zero past the last pixel */
+static void pq_slice(const unsigned char *pixels, int n, int s, float *x) {
+    for (int t = 0; t < PQ_DIMS; t++) {
+        int p = s * PQ_DIMS + t;
+        x[t] = p < n ? pixels[p] : 0;
+    }
+}
+
+/* Subspace s of the residual of `pixels` from `centroid`, zero past the last pixel */
+static void pq_residual(const unsigned char *pixels, const unsigned char *centroid, int n,
+                        int s, float *residual) {
+    for (int t = 0; t < PQ_DIMS; t++) {
+        int p = s * PQ_DIMS + t;
+        residual[t] = p < n ? (float)pixels[p] - centroid[p] : 0;
+    }
+}
+
+/* Squared distances of a residual subspace to the PQ_CODES centroids of `codebook` */
+static void pq_distances(const float *codebook, const float *residual, float *dists) {
+    // Summed in a local array, which the compiler keeps in vector registers
+    float sums[PQ_CODES] = {0};
+    for (int t = 0; t < PQ_DIMS; t++) {
+        for (int k = 0; k < PQ_CODES; k++) {
+            float d = residual[t] - codebook[t * PQ_CODES + k];
+            sums[k] += d * d;
+        }
+    }
+    memcpy(dists, sums, sizeof(sums));
+}
+
+/* Dot products of a subspace of an image, as floats, with the PQ_CODES centroids of `codebook` */
+static void pq_products(const float *codebook, const float *x, float *dots) {
+    float sums[PQ_CODES] = {0};
+    for (int t = 0; t < PQ_DIMS; t++) {
+        for (int k = 0; k < PQ_CODES; k++) {
+            sums[k] += x[t] * codebook[t * PQ_CODES + k];
+        }
+    }
+    memcpy(dots, sums, sizeof(sums));
+}
+
+/* Return the code of the centroid of `codebook` nearest to a residual subspace */
+static int pq_encode(const float *codebook, const float *residual) {
+    float dists[PQ_CODES];
+    pq_distances(codebook, residual, dists);
+    int best = 0;
+    for (int k = 1; k < PQ_CODES; k++) {
+        if (dists[k] < dists[best]) {
+            best = k;
+        }
+    }
+    return best;
+}
+
+/**
+ * Fit the codebook of every subspace of `ivf` by k-means on the residuals
+ * of a sample of the images from their cells, starting from residuals
+ * spread over the sample
+ */
+static void fit_codebooks(const Dataset *data, Ivf *ivf, const int *cell) {
+    int n = data->num_pixels;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    int step = (data->num_items + IVF_SAMPLE - 1) / IVF_SAMPLE;
+    int count = (data->num_items + step - 1) / step;
+    ivf->codebooks = calloc((size_t)ivf->subspaces * PQ_DIMS * PQ_CODES, sizeof(float));
+    float *residuals = malloc(sizeof(float) * PQ_DIMS * count);
+    if (ivf->codebooks == NULL || residuals == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int s = 0; s * PQ_DIMS < n; s++) {
+        float *codebook = ivf->codebooks + (size_t)s * PQ_DIMS * PQ_CODES;
+        for (int j = 0; j < count; j++) {
+            int i = j * step;
+            pq_residual(data->pixels + (size_t)i * data->stride,
+                        ivf->centroids + cell[i] * stride, n, s, residuals + j * PQ_DIMS);
+        }
+        for (int k = 0; k < PQ_CODES; k++) {
+            const float *start = residuals + (size_t)k * count / PQ_CODES * PQ_DIMS;
+            for (int t = 0; t < PQ_DIMS; t++) {
+                codebook[t * PQ_CODES + k] = start[t];
+            }
+        }
+        for (int round = 0; round < IVF_ROUNDS; round++) {
+            double sums[PQ_CODES][PQ_DIMS] = {{0}};
+            int counts[PQ_CODES] = {0};
+            for (int j = 0; j < count; j++) {
+                int k = pq_encode(codebook, residuals + j * PQ_DIMS);
+                counts[k]++;
+                for (int t = 0; t < PQ_DIMS; t++) {
+                    sums[k][t] += residuals[j * PQ_DIMS + t];
+                }
+            }
+            for (int k = 0; k < PQ_CODES; k++) {
+                for (int t = 0; counts[k] > 0 && t < PQ_DIMS; t++) {
+                    codebook[t * PQ_CODES + k] = sums[k][t] / counts[k];
+                }
+            }
+        }
+    }
+    free(residuals);
+}
+
+/**
+ * Fill in the cell terms of `ivf`: |y|^2 + 2 c.y for every code y of every
+ * subspace and every cell centroid c, the part of the squared distance
+ * |q - c - y|^2 of a query q to an encoded image that does not depend on q
+ */
+static void fit_cell_terms(const Dataset *data, Ivf *ivf) {
+    int n = data->num_pixels;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    size_t terms_len = (size_t)ivf->subspaces * PQ_CODES;
+    ivf->cell_terms = calloc(ivf->num_cells * terms_len, sizeof(float));
+    if (ivf->cell_terms == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int s = 0; s * PQ_DIMS < n; s++) {
+        const float *codebook = ivf->codebooks + (size_t)s * PQ_DIMS * PQ_CODES;
+        float sq_norms[PQ_CODES] = {0};
+        for (int t = 0; t < PQ_DIMS; t++) {
+            for (int k = 0; k < PQ_CODES; k++) {
+                sq_norms[k] += codebook[t * PQ_CODES + k] * codebook[t * PQ_CODES + k];
+            }
+        }
+        for (int c = 0; c < ivf->num_cells; c++) {
+            float x[PQ_DIMS], dots[PQ_CODES];
+            float *terms = ivf->cell_terms + c * terms_len + s * PQ_CODES;
+            pq_slice(ivf->centroids + c * stride, n, s, x);
+            pq_products(codebook, x, dots);
+            for (int k = 0; k < PQ_CODES; k++) {
+                terms[k] = sq_norms[k] + 2 * dots[k];
+            }
+        }
+    }
+}
+
+/**
+ * ivf_training builds an inverted file over a training set (IVF-PQ): the
+ * images are split into `num_cells` cells by k-means, and each is kept as a
+ * 4-bit code per subspace of PQ_DIMS pixels of its residual from its cell's
+ * centroid, half a byte per 8 pixels. The codes of 60000 28x28 digits take
+ * under 3 MB, so they stay in cache where the pixels take 47 MB.
+ *
+ * knn_predict then probes the `nprobe` cells with the centroids nearest to
+ * the query. For each, it tabulates the squared distances of the query's
+ * residual to the 16 centroids of every subspace, quantized to bytes, from
+ * terms stored per cell and terms computed once per query, and adds up the
+ * entries of the codes of 32 images at a time with in-register table
+ * lookups (see pq_scan). The K * `multiplier` images with the nearest
+ * approximate distances are then ranked exactly under the metric against
+ * their pixels, like a shortlist (see binarize_training), which it replaces.
+ * Neighbors outside the probed cells or the shortlist are missed, so the
+ * search is approximate: more probes or a longer shortlist miss fewer.
+ *
+ * An inverted file read from an index (see map_index) is kept, probing
+ * `nprobe` cells with the new multiplier, and asking for another number of
+ * cells is an error.
+ *
+ * The codes are in the stored pixel order, so call it after
+ * prepare_training. It takes precedence over every search but the
+ * other shortlists and the graph (see hnsw_training).
+ */
+void ivf_training(Dataset *data, int num_cells, int nprobe, int multiplier) {
+    int n = data->num_pixels;
+    data->shortlist = multiplier;
+    if (data->num_items == 0) {
+        return;
+    }
+    if (data->ivf != NULL && num_cells != data->ivf->num_cells) {
+        fprintf(stderr, "Error: the training set already has an inverted file of %d cells\n",
+                data->ivf->num_cells);
+        exit(1);
+    }
+    if (num_cells < 1 || num_cells > data->num_items) {
+        fprintf(stderr, "Error: expected 1 to %d cells\n", data->num_items);
+        exit(1);
+    }
+    if (nprobe < 1 || nprobe > num_cells) {
+        fprintf(stderr, "Error: expected 1 to %d cells to probe\n", num_cells);
+        exit(1);
+    }
+    if (data->ivf != NULL) {
+        data->ivf->nprobe = nprobe;
+        return;
+    }
+    Ivf *ivf = calloc(1, sizeof(Ivf));
+    int *cell = malloc(sizeof(int) * data->num_items);
+    if (ivf == NULL || cell == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    ivf->num_cells = num_cells;
+    ivf->nprobe = nprobe;
+    ivf->subspaces = ivf_subspaces(n);
+    fit_cells(data, ivf, cell);
+    fit_codebooks(data, ivf, cell);
+    fit_cell_terms(data, ivf);
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+
+    // Lay out the images cell by cell, in blocks of PQ_BLOCK
+    ivf->cell_start = calloc(num_cells + 1, sizeof(int));
+    int *filled = calloc(num_cells, sizeof(int));
+    if (ivf->cell_start == NULL || filled == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        filled[cell[i]]++;
+    }
+    for (int c = 0; c < num_cells; c++) {
+        ivf->cell_start[c + 1] = ivf->cell_start[c] + (filled[c] + PQ_BLOCK - 1) / PQ_BLOCK;
+        filled[c] = 0;
+    }
+    int num_blocks = ivf->cell_start[num_cells];
+    size_t block_len = (size_t)16 * ivf->subspaces;
+    ivf->ids = malloc(sizeof(int) * PQ_BLOCK * num_blocks);
+    ivf->codes = calloc(num_blocks, block_len);
+    if (ivf->ids == NULL || ivf->codes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int j = 0; j < PQ_BLOCK * num_blocks; j++) {
+        ivf->ids[j] = -1;
+    }
+    for (int i = 0; i < data->num_items; i++) {
+        int c = cell[i];
+        int slot = filled[c]++;
+        int block = ivf->cell_start[c] + slot / PQ_BLOCK;
+        int j = slot % PQ_BLOCK;
+        ivf->ids[block * PQ_BLOCK + j] = i;
+        unsigned char *codes = ivf->codes + block * block_len;
+        for (int s = 0; s * PQ_DIMS < n; s++) {
+            float residual[PQ_DIMS];
+            pq_residual(data->pixels + (size_t)i * data->stride, ivf->centroids + c * stride, n,
+                        s, residual);
+            int code = pq_encode(ivf->codebooks + (size_t)s * PQ_DIMS * PQ_CODES, residual);
+            codes[16 * s + j % 16] |= j < 16 ? code : code << 4;
+        }
+    }
+    free(filled);
+    free(cell);
+    data->ivf = ivf;
+}
+
+/* Bytes the codes of the inverted file of `data` take, or 0 if it has none */
+size_t ivf_code_bytes(const Dataset *data) {
+    const Ivf *ivf = data->ivf;
+    if (ivf == NULL) {
+        return 0;
+    }
+    return (size_t)ivf->cell_start[ivf->num_cells] * 16 * ivf->subspaces;
+}
+
+/** 
+ * Return the squared euclidean distance between the image pixels, summed
+ * entirely in integer arithmetic. 784 pixels of at most 255^2 each fit
+ * comfortably in 32 bits.
+ */
+unsigned int distance_euclidean_sq(Image *a, Image *b) {
+    return kernels.sq_diff(a->data, b->data, a->sx * a->sy);
+}
+
+/**
+ * Early-abandoning variant of distance_euclidean_sq: if the squared distance
+ * is above `bound`, some value above `bound` is returned as soon as the
+ * partial sum (checked block by block) exceeds it.
+ */
+unsigned int distance_euclidean_sq_bounded(Image *a, Image *b, unsigned int bound) {
+    return kernels.sq_diff_bounded(a->data, b->data, a->sx * a->sy, bound);
+}
+
+/**
+ * Return the manhattan distance between the image pixels,
+ * d = sum(|a[i] - b[i]|), summed exactly in integers.
+ */
+double distance_manhattan(Image *a, Image *b) {
+    return kernels.sad(a->data, b->data, a->sx * a->sy);
+}
+
+/** 
+ * Return the euclidean distance between the image pixels (as vectors).
+ * Specifically  d = sqrt( sum((a[i]-b[i])^2))
+ */
+double distance_euclidean(Image *a, Image *b) {
+    return sqrt(distance_euclidean_sq(a, b));
+}
+
+/*
+ * Lower bound on the euclidean distance of training image i to `query` from
+ * the pivot table (see pivot_training), shrunk by PIVOT_SLACK
+ */
+static double pivot_bound(const Dataset *data, const Query *query, int i) {
+    return data->kernels->max_diff_f32(data->pivot_dists + (size_t)i * data->pivot_stride,
+                                       query->pivot_dists, data->pivot_stride) - PIVOT_SLACK;
+}
+
+/**
+ * A lower bound on the squared distance of training image i to `query` that
+ * is above `limit`, from the block sums (see prepare_block_sums) or from
+ * the pivot table (see pivot_training), or 0 if neither gives one. The
+ * block sums go first, as they are cheaper and rule out more images.
+ */
+static double lower_bound_sq(const Dataset *data, const Query *query, int i, unsigned int limit) {
+    if (query->block_sums != NULL) {
+        unsigned long long d = data->kernels->sq_diff_u16(
+            data->block_sums + (size_t)i * data->sums_stride, query->block_sums, data->sums_stride);
+        if (d > 16ULL * limit) {
+            return d / 16.0;
+        }
+    }
+    if (query->pivot_dists != NULL) {
+        double d = pivot_bound(data, query, i);
+        if (d > 0 && d * d > limit) {
+            return d * d;
+        }
+    }
+    return 0;
+}
+
+/* |a - b|^2 = |a|^2 + |b|^2 - 2 a.b, exactly in unsigned arithmetic */
+static double dot_key_euclidean(const Dataset *data, int i, unsigned int query_sq, unsigned int dot) {
+    return query_sq + data->sq_norms[i] - 2 * dot;
+}
+
+/* Return 1 if dot products with single queries should use the sparse lists */
+static int uses_sparse(const Dataset *data) {
+    return data->sparse_start != NULL && data->density < data->kernels->sparse_density;
+}
+
+/* Return 1 if dot products with blocks of queries should use the sparse lists */
+static int uses_sparse_block(const Dataset *data) {
+    return data->sparse_start != NULL && data->density < data->kernels->sparse_block_density;
+}
+
+/* Dot product of training image i with the query over the image's nonzero pixels */
+static unsigned int sparse_dot(const Dataset *data, const Query *query, int i) {
+    size_t start = data->sparse_start[i];
+    return data->kernels->dot_sparse(data->sparse_index + start, data->sparse_values + start,
+                                     data->sparse_start[i + 1] - start, query->pixels);
+}
+
+/**
+ * For euclidean the key is the squared distance, which needs neither sqrt
+ * nor floating point sums. Every sum is abandoned once it passes the bound,
+ * and once there is a bound, images whose block sums or pivot distances
+ * already put them above it are skipped without touching their pixels.
+ * Sparse images (see prepare_sparse) are keyed from a sparse dot product
+ * instead, which cannot be abandoned but skips every blank pixel.
+ * With a pixel-major copy of the training set (see transpose_training),
+ * whole blocks of COLUMN_BLOCK images are scored per kernel call instead.
+ *
+ * The query's pixels that the training set does not store add
+ * `dropped_sq` to every distance, so the stored ones are summed against
+ * what is left of the bound.
+ *
+ * Keys are doubles because that is the type every metric's keys share,
+ * but an exact euclidean key is always an integer sum. It is below 2^53,
+ * so the double holds it exactly and ranking compares exact integers.
+ * Only keys of skipped images are fractional, and those are above the
+ * bound.
+ */
+static void score_euclidean(const Dataset *data, const Query *query, int start, int end,
+                            double bound, double *keys) {
+    int n = data->num_pixels;
+    unsigned int limit = bound < 0 ? 0 : bound < UINT_MAX ? (unsigned int)bound : UINT_MAX;
+    unsigned int dropped = query->dropped_sq;
+    unsigned int rest = limit == UINT_MAX ? UINT_MAX : limit > dropped ? limit - dropped : 0;
+    if (data->columns != NULL && start % COLUMN_BLOCK == 0) {
+        unsigned int block[COLUMN_BLOCK];
+        for (int b = start; b < end; b += COLUMN_BLOCK) {
+            data->kernels->sq_diff_columns(data->columns + (size_t)b * n, query->pixels, n,
+                                           rest, block);
+            for (int j = b; j < end && j < b + COLUMN_BLOCK; j++) {
+                keys[j - start] = (double)block[j - b] + dropped;
+            }
+        }
+        return;
+    }
+    const unsigned char *train = data->pixels + (size_t)start * data->stride;
+    for (int i = start; i < end; i++, train += data->stride) {
+        double lower = limit < UINT_MAX ? lower_bound_sq(data, query, i, limit) : 0;
+        if (lower > 0) {
+            keys[i - start] = lower;
+        } else if (uses_sparse(data)) {
+            keys[i - start] = dot_key_euclidean(data, i, query->sq_norm,
+                                                sparse_dot(data, query, i));
+        } else {
+            keys[i - start] = (double)data->kernels->sq_diff_bounded(train, query->pixels, n, rest) +
+                              dropped;
+        }
+    }
+}
+
+/* |a - b| >= |norm(a) - norm(b)| */
+static double norm_bound_euclidean(double gap) {
+    return gap * gap;
+}
+
+/**
+ * The cosine distance only grows as the cosine similarity
+ * dot(a, b) / (|a| |b|) shrinks, and |b| is the same for every candidate of
+ * one query, so the key is just -dot(a, b) / |a| using the norm stored at
+ * load time, with a sparse dot product for sparse images (see
+ * prepare_sparse). Blank training images have no defined distance and are
+ * never picked.
+ */
+static double dot_key_cosine(const Dataset *data, int i, unsigned int query_sq, unsigned int dot) {
+    if (data->norms[i] == 0) {
+        return INFINITY;
+    }
+    return -(double)dot / data->norms[i];
+}
+
+static void score_cosine(const Dataset *data, const Query *query, int start, int end,
+                         double bound, double *keys) {
+    int n = data->num_pixels;
+    const unsigned char *train = data->pixels + (size_t)start * data->stride;
+    for (int i = start; i < end; i++, train += data->stride) {
+        unsigned int dot = uses_sparse(data) ? sparse_dot(data, query, i)
+                                             : data->kernels->dot(train, query->pixels, n);
+        keys[i - start] = dot_key_cosine(data, i, 0, dot);
+    }
+}
+
+/* Like lower_bound_sq, for the manhattan distance */
+static double lower_bound_abs(const Dataset *data, const Query *query, int i, unsigned int limit) {
+    if (query->block_sums != NULL) {
+        unsigned int d = data->kernels->sad_u16(data->block_sums + (size_t)i * data->sums_stride,
+                                                query->block_sums, data->sums_stride);
+        if (d > limit) {
+            return d;
+        }
+    }
+    if (query->pivot_dists != NULL) {
+        double d = pivot_bound(data, query, i);
+        if (d > limit) {
+            return d;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The manhattan distance is its own key: an integer sum of absolute
+ * differences, abandoned once it passes the bound. Block sums and pivots
+ * skip images like they do for euclidean, and the query's pixels that the
+ * training set does not store add `dropped_sum` to every distance.
+ */
+static void score_manhattan(const Dataset *data, const Query *query, int start, int end,
+                            double bound, double *keys) {
+    int n = data->num_pixels;
+    unsigned int limit = bound < 0 ? 0 : bound < UINT_MAX ? (unsigned int)bound : UINT_MAX;
+    unsigned int dropped = query->dropped_sum;
+    unsigned int rest = limit == UINT_MAX ? UINT_MAX : limit > dropped ? limit - dropped : 0;
+    const unsigned char *train = data->pixels + (size_t)start * data->stride;
+    for (int i = start; i < end; i++, train += data->stride) {
+        double lower = limit < UINT_MAX ? lower_bound_abs(data, query, i, limit) : 0;
+        keys[i - start] = lower > 0 ? lower
+                                    : (double)data->kernels->sad_bounded(train, query->pixels, n,
+                                                                         rest) + dropped;
+    }
+}
+
+/* The manhattan distance is at least the euclidean one */
+static double norm_bound_manhattan(double gap) {
+    return gap;
+}
+
+const Metric metric_euclidean = {
+    "euclidean", distance_euclidean, prepare_euclidean, score_euclidean, dot_key_euclidean,
+    norm_bound_euclidean, 1
+};
+
+const Metric metric_cosine = {
+    "cosine", distance_cosine, prepare_sparse, score_cosine, dot_key_cosine, NULL, 0
+};
+
+const Metric metric_manhattan = {
+    "manhattan", distance_manhattan, prepare_block_sums, score_manhattan, NULL,
+    norm_bound_manhattan, 0
+};
+
+/**
+ * Bounded max-heap holding the best candidates seen so far, ordered by rank
+ * key and then by image index, with the worst one at the root. `bound` caches
+ * the root's key once the heap is full (INFINITY before), so most candidates
+ * are rejected with a single comparison that never touches the array. A heap
+ * of capacity 0 is full from the start and its bound is -INFINITY, so it
+ * rejects every candidate without reading the root it does not have.
+ */
+typedef struct {
+    Knn_item *items;
+    int size;
+    int capacity;
+    double bound;
+} Knn_heap;
+
+static void heap_init(Knn_heap *h, Knn_item *items, int capacity) {
+    h->items = items;
+    h->size = 0;
+    h->capacity = capacity;
+    h->bound = capacity > 0 ? INFINITY : -INFINITY;
+}
+
+/* Return 1 if `a` ranks after `b` */
+static inline int knn_item_after(const Knn_item *a, const Knn_item *b) {
+    return a->dist > b->dist || (a->dist == b->dist && a->img_idx > b->img_idx);
+}
+
+static void heap_sift_down(Knn_heap *h, int i) {
+    Knn_item item = h->items[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->size) {
+            break;
+        }
+        if (child + 1 < h->size && knn_item_after(&h->items[child + 1], &h->items[child])) {
+            child++;
+        }
+        if (!knn_item_after(&h->items[child], &item)) {
+            break;
+        }
+        h->items[i] = h->items[child];
+        i = child;
+    }
+    h->items[i] = item;
+}
+
+static void heap_sift_up(Knn_heap *h, int i) {
+    Knn_item item = h->items[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!knn_item_after(&item, &h->items[parent])) {
+            break;
+        }
+        h->items[i] = h->items[parent];
+        i = parent;
+    }
+    h->items[i] = item;
+}
+
+/**
+ * Offer image `idx` with rank key `dist` to the heap. Keys of INFINITY mark
+ * images that can never be neighbors.
+ */
+static inline void heap_offer(Knn_heap *h, double dist, int idx) {
+    if (dist > h->bound) {
+        return;
+    }
+    Knn_item item = {dist, idx};
+    if (h->size < h->capacity) {
+        if (dist == INFINITY) {
+            return;
+        }
+        h->items[h->size] = item;
+        heap_sift_up(h, h->size++);
+    } else if (knn_item_after(&h->items[0], &item)) {
+        h->items[0] = item;
+        heap_sift_down(h, 0);
+    } else {
+        return;
+    }
+    if (h->size == h->capacity) {
+        h->bound = h->items[0].dist;
+    }
+}
+
+/* Remove the worst item from a heap that is not empty, and return it */
+static Knn_item heap_pop(Knn_heap *h) {
+    Knn_item top = h->items[0];
+    h->items[0] = h->items[--h->size];
+    heap_sift_down(h, 0);
+    h->bound = INFINITY;
+    return top;
+}
+
+/*
+ * Scratch space of the search, one buffer per use below. Buffers are reused
+ * across calls and only grow, so large K neither reallocates per query nor
+ * risks overflowing the stack. Every buffer starts on a cache line.
+ */
+typedef struct {
+    void *buf;
+    size_t cap;  // Bytes allocated
+} Scratch;
+
+enum {
+    NEIGHBORS_SCRATCH,       // Neighbors of knn_predict
+    QUERY_SCRATCH,           // Copy of the query in the training set's layout
+    TRAIN_SCRATCH,           // A training image with its dropped pixels put
+                             // back, for knn_neighbors
+    SHORTLIST_SCRATCH,       // Candidates of a shortlist or of the graph
+    QUERY_BITS_SCRATCH,      // The binarized query, for the Hamming shortlist
+    QUERY_SUMS_SCRATCH,      // Block sums of the query
+    QUERY_PROJECTED_SCRATCH, // The projected query, for the PCA shortlist
+    QUERY_PIVOTS_SCRATCH,    // Distances of the query to the pivots
+    VISIT_SCRATCH,           // Visit marks of the graph search
+    GRAPH_SCRATCH,           // Images left to expand by the graph search
+    QUERY_TERMS_SCRATCH,     // Per query terms of the inverted file's tables
+    QUERY_LUTS_SCRATCH,      // Distance tables of the inverted file
+    IVF_PROBES_SCRATCH,      // Cells the inverted file search probes
+    NUM_SCRATCH
+};
+
+static Scratch scratches[NUM_SCRATCH];
+
+/* Return scratch buffer `which`, grown to at least `bytes` */
+static void *grow_scratch(int which, size_t bytes) {
+    Scratch *s = &scratches[which];
+    if (bytes > s->cap) {
+        free(s->buf);
+        if (posix_memalign(&s->buf, CACHE_LINE, bytes) != 0) {
+            perror("posix_memalign");
+            exit(1);
+        }
+        s->cap = bytes;
+    }
+    return s->buf;
+}
+
+/*
+ * Visit marks of the graph search: image i was visited by the current
+ * search of a layer if visit_marks[i] == visit_epoch, so starting a new
+ * search does not clear the array
+ */
+static unsigned int *visit_marks = NULL;
+static unsigned int visit_epoch = 0;
+
+static unsigned int new_visit_epoch(int len) {
+    size_t bytes = sizeof(unsigned int) * len;
+    if (bytes > scratches[VISIT_SCRATCH].cap) {
+        visit_marks = grow_scratch(VISIT_SCRATCH, bytes);
+        memset(visit_marks, 0, bytes);
+        visit_epoch = 0;
+    }
+    if (++visit_epoch == 0) {
+        memset(visit_marks, 0, scratches[VISIT_SCRATCH].cap);
+        visit_epoch = 1;
+    }
+    return visit_epoch;
+}
+
+static void free_knn_scratch(void) {
+    for (int i = 0; i < NUM_SCRATCH; i++) {
+        free(scratches[i].buf);
+        scratches[i].buf = NULL;
+        scratches[i].cap = 0;
+    }
+    visit_marks = NULL;
+}
+
+static int compare_knn_items(const void *a, const void *b) {
+    const Knn_item *x = a, *y = b;
+    if (x->dist != y->dist) {
+        return x->dist < y->dist ? -1 : 1;
+    }
+    return x->img_idx - y->img_idx;
+}
+
+/* Return 1 if searches of `data` rank only a shortlist of images */
+static int uses_shortlist(const Dataset *data) {
+    return data->shortlist > 0 && (data->bits != NULL || data->projected != NULL);
+}
+
+/**
+ * Search of a dataset with a projected copy (see project_training) or a 1-bit
+ * copy (see binarize_training): collect the K * shortlist images nearest to
+ * the projected `query`, or to the binarized one in Hamming distance, then
+ * rank only those under the metric, nearest first so the bound tightens
+ * early.
+ */
+static int shortlist_neighbors(Dataset *data, const Query *query, int K,
+                               const Metric *metric, Knn_item *smallest) {
+    int n = data->num_pixels;
+    int len = (long long)K * data->shortlist < data->num_items ? K * data->shortlist : data->num_items;
+    Knn_item *candidates = grow_scratch(SHORTLIST_SCRATCH, sizeof(Knn_item) * len);
+    Knn_heap coarse;
+    heap_init(&coarse, candidates, len);
+    if (data->projected != NULL) {
+        int dims = data->projection->dims;
+        float *projected = grow_scratch(QUERY_PROJECTED_SCRATCH, sizeof(float) * dims);
+        project_image(data->projection, query->pixels, projected);
+        const float *train = data->projected;
+        for (int i = 0; i < data->num_items; i++, train += dims) {
+            heap_offer(&coarse, data->kernels->sq_diff_f32(train, projected, dims), i);
+        }
+    } else {
+        unsigned long long *bits =
+            grow_scratch(QUERY_BITS_SCRATCH, sizeof(unsigned long long) * data->bits_stride);
+        binarize(query->pixels, n, bits);
+        const unsigned long long *train = data->bits;
+        for (int i = 0; i < data->num_items; i++, train += data->bits_stride) {
+            heap_offer(&coarse, data->kernels->hamming(train, bits, n), i);
+        }
+    }
+    qsort(candidates, coarse.size, sizeof(Knn_item), compare_knn_items);
+
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+    for (int c = 0; c < coarse.size; c++) {
+        int i = candidates[c].img_idx;
+        double key;
+        metric->score(data, query, i, i + 1, heap.bound, &key);
+        heap_offer(&heap, key, i);
+    }
+    return heap.size;
+}
+
+/**
+ * Search of a dataset with a copy sorted by norm (see
+ * order_training_by_norm): score blocks of the copy outward from the query's
+ * norm, each time on the side whose next image is nearer in norm. Every
+ * image left is at least as far in norm as that one, so the search stops as
+ * soon as the metric's norm bound for its gap is above the K-th key. Gaps
+ * are shrunk by NORM_SLACK first, so rounded norms never prune an image
+ * that ties with the K-th one.
+ */
+static int norm_neighbors(Dataset *data, const Query *query, int K,
+                          const Metric *metric, Knn_item *smallest) {
+    const Dataset *sorted = data->by_norm;
+    double norm = sqrt(query->sq_norm);
+
+    // Find the first image whose norm is at least the query's
+    int lo = 0, hi = sorted->num_items;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sorted->norms[mid] < norm) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+    double keys[SCORE_BLOCK];
+    int down = lo, up = lo;  // images down to up - 1 are scored
+    while (down > 0 || up < sorted->num_items) {
+        double gap_up = up < sorted->num_items ? sorted->norms[up] - norm : INFINITY;
+        double gap_down = down > 0 ? norm - sorted->norms[down - 1] : INFINITY;
+        double gap = gap_up <= gap_down ? gap_up : gap_down;
+        if (gap > NORM_SLACK && metric->norm_bound(gap - NORM_SLACK) > heap.bound) {
+            break;
+        }
+        int start, end;
+        if (gap_up <= gap_down) {
+            start = up;
+            end = up = sorted->num_items - up < SCORE_BLOCK ? sorted->num_items : up + SCORE_BLOCK;
+        } else {
+            end = down;
+            start = down = down < SCORE_BLOCK ? 0 : down - SCORE_BLOCK;
+        }
+        metric->score(sorted, query, start, end, heap.bound, keys);
+        for (int j = start; j < end; j++) {
+            heap_offer(&heap, keys[j - start], data->norm_order[j]);
+        }
+    }
+    return heap.size;
+}
+
+/**
+ * Offer the images of the subtree at positions lo to hi - 1 of the
+ * vantage-point tree of `data` to `heap`. A subtree is skipped once the
+ * metric's norm bound for the gap between the query's distance to the
+ * vantage point and the subtree's range of distances, shrunk by
+ * PIVOT_SLACK, is above the K-th key.
+ */
+static void vp_tree_search(const Dataset *data, const Query *query, const Metric *metric,
+                           Knn_heap *heap, int lo, int hi) {
+    const Vp_tree *tree = data->vp_tree;
+    const Dataset *images = tree->images;
+    double keys[VP_LEAF];
+    if (hi - lo <= VP_LEAF) {
+        metric->score(images, query, lo, hi, heap->bound, keys);
+        for (int j = lo; j < hi; j++) {
+            heap_offer(heap, keys[j - lo], tree->order[j]);
+        }
+        return;
+    }
+    metric->score(images, query, lo, lo + 1, heap->bound, keys);
+    heap_offer(heap, keys[0], tree->order[lo]);
+
+    double d = sqrt(data->kernels->sq_diff(images->pixels + (size_t)lo * images->stride,
+                                           query->pixels, data->num_pixels) +
+                    query->dropped_sq);
+    const float *bounds = tree->bounds + (size_t)4 * lo;
+    int mid = lo + 1 + (hi - lo - 1) / 2;
+    double gap_in = fmax(d - bounds[1], bounds[0] - d) - PIVOT_SLACK;
+    double gap_out = fmax(d - bounds[3], bounds[2] - d) - PIVOT_SLACK;
+    int first_lo = lo + 1, first_hi = mid, second_lo = mid, second_hi = hi;
+    double first_gap = gap_in, second_gap = gap_out;
+    if (gap_out < gap_in) {
+        first_lo = mid;
+        first_hi = hi;
+        second_lo = lo + 1;
+        second_hi = mid;
+        first_gap = gap_out;
+        second_gap = gap_in;
+    }
+    if (first_gap <= 0 || metric->norm_bound(first_gap) <= heap->bound) {
+        vp_tree_search(data, query, metric, heap, first_lo, first_hi);
+    }
+    if (second_gap <= 0 || metric->norm_bound(second_gap) <= heap->bound) {
+        vp_tree_search(data, query, metric, heap, second_lo, second_hi);
+    }
+}
+
+/* Search of a dataset with a vantage-point tree (see vp_tree_training) */
+static int vp_tree_neighbors(Dataset *data, const Query *query, int K,
+                             const Metric *metric, Knn_item *smallest) {
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+    vp_tree_search(data, query, metric, &heap, 0, data->num_items);
+    return heap.size;
+}
+
+/* Row of the links of image i on `level` of `graph` */
+static int *hnsw_row(const Hnsw *graph, int i, int level) {
+    if (level == 0) {
+        return graph->links0 + (size_t)i * (1 + 2 * graph->M);
+    }
+    return graph->links + ((size_t)graph->upper_start[i] + level - 1) * (1 + graph->M);
+}
+
+/**
+ * Search `level` of the graph of `data` for the images nearest to `pixels`
+ * in squared euclidean distance over the stored pixels, starting from the
+ * images already in `found`: expand the nearest image not expanded yet,
+ * offering its unvisited links to `found`, until it is farther than every
+ * image `found` keeps once full.
+ */
+static void hnsw_search_layer(const Dataset *data, const Hnsw *graph,
+                              const unsigned char *pixels, int level, Knn_heap *found) {
+    int n = data->num_pixels;
+    unsigned int epoch = new_visit_epoch(data->num_items);
+    Knn_heap next;  // keyed by minus the distance, so the nearest is the root
+    Knn_item *expand = grow_scratch(GRAPH_SCRATCH, sizeof(Knn_item) * data->num_items);
+    heap_init(&next, expand, data->num_items);
+    for (int j = 0; j < found->size; j++) {
+        visit_marks[found->items[j].img_idx] = epoch;
+        heap_offer(&next, -found->items[j].dist, found->items[j].img_idx);
+    }
+    while (next.size > 0) {
+        Knn_item nearest = heap_pop(&next);
+        if (-nearest.dist > found->bound) {
+            break;
+        }
+        const int *row = hnsw_row(graph, nearest.img_idx, level);
+        for (int k = 1; k <= row[0]; k++) {
+            __builtin_prefetch(data->pixels + (size_t)row[k] * data->stride);
+        }
+        for (int k = 1; k <= row[0]; k++) {
+            int i = row[k];
+            if (visit_marks[i] == epoch) {
+                continue;
+            }
+            visit_marks[i] = epoch;
+            double d = data->kernels->sq_diff(data->pixels + (size_t)i * data->stride, pixels, n);
+            if (found->size < found->capacity || d < found->bound) {
+                heap_offer(&next, -d, i);
+                heap_offer(found, d, i);
+            }
+        }
+    }
+}
+
+/**
+ * Walk greedily from the entry of the graph of `data` towards `pixels`
+ * through the layers above `level`, and leave the nearest image found in
+ * `found`, set up to keep `ef` images from then on.
+ */
+static void hnsw_descend(const Dataset *data, const Hnsw *graph, const unsigned char *pixels,
+                         int level, int ef, Knn_heap *found) {
+    Knn_item *items = found->items;
+    heap_init(found, items, 1);
+    heap_offer(found, data->kernels->sq_diff(data->pixels + (size_t)graph->entry * data->stride,
+                                             pixels, data->num_pixels), graph->entry);
+    for (int l = graph->max_level; l > level; l--) {
+        hnsw_search_layer(data, graph, pixels, l, found);
+    }
+    found->capacity = ef;
+    found->bound = INFINITY;
+}
+
+/**
+ * Replace `row` with at most `max` links picked among `count` candidates
+ * sorted by increasing distance to the image the row belongs to. A
+ * candidate is only kept if it is nearer to that image than to every link
+ * kept before it, so links spread out in every direction instead of
+ * bunching up in the nearest cluster.
+ */
+static void hnsw_select(const Dataset *data, const Knn_item *candidates, int count,
+                        int max, int *row) {
+    int n = data->num_pixels;
+    row[0] = 0;
+    for (int c = 0; c < count && row[0] < max; c++) {
+        const unsigned char *x = data->pixels + (size_t)candidates[c].img_idx * data->stride;
+        int keep = 1;
+        for (int r = 1; keep && r <= row[0]; r++) {
+            keep = data->kernels->sq_diff(x, data->pixels + (size_t)row[r] * data->stride, n) >=
+                   candidates[c].dist;
+        }
+        if (keep) {
+            row[++row[0]] = candidates[c].img_idx;
+        }
+    }
+}
+
+/**
+ * Link image q into the graph on every layer up to its level, once the
+ * images inserted before it are. `found` and `sorted` hold HNSW_BUILD_EF
+ * items, and `spill` 2 M + 1.
+ */
+static void hnsw_insert(const Dataset *data, Hnsw *graph, int q, Knn_item *found_buf,
+                        Knn_item *sorted, Knn_item *spill) {
+    int n = data->num_pixels;
+    int level = graph->upper_start[q + 1] - graph->upper_start[q];
+    const unsigned char *pixels = data->pixels + (size_t)q * data->stride;
+    Knn_heap found = {found_buf};
+    hnsw_descend(data, graph, pixels, level, HNSW_BUILD_EF, &found);
+    for (int l = level < graph->max_level ? level : graph->max_level; l >= 0; l--) {
+        hnsw_search_layer(data, graph, pixels, l, &found);
+        int count = found.size;
+        memcpy(sorted, found.items, sizeof(Knn_item) * count);
+        qsort(sorted, count, sizeof(Knn_item), compare_knn_items);
+        int *row = hnsw_row(graph, q, l);
+        hnsw_select(data, sorted, count, graph->M, row);
+
+        // Link back from every new neighbor, reselecting its links if its
+        // row is full
+        int max = l == 0 ? 2 * graph->M : graph->M;
+        for (int k = 1; k <= row[0]; k++) {
+            int *back = hnsw_row(graph, row[k], l);
+            if (back[0] < max) {
+                back[++back[0]] = q;
+                continue;
+            }
+            const unsigned char *x = data->pixels + (size_t)row[k] * data->stride;
+            for (int j = 0; j < back[0]; j++) {
+                spill[j].img_idx = back[j + 1];
+                spill[j].dist = data->kernels->sq_diff(
+                    x, data->pixels + (size_t)back[j + 1] * data->stride, n);
+            }
+            spill[max].img_idx = q;
+            spill[max].dist = data->kernels->sq_diff(x, pixels, n);
+            qsort(spill, max + 1, sizeof(Knn_item), compare_knn_items);
+            hnsw_select(data, spill, max + 1, max, back);
+        }
+    }
+    if (level > graph->max_level) {
+        graph->entry = q;
+        graph->max_level = level;
+    }
+}
+
+static Hnsw *alloc_hnsw(void) {
+    Hnsw *graph = calloc(1, sizeof(Hnsw));
+    if (graph == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return graph;
+}
+
+/* Free `graph`, whose arrays may lie in the mapping of `owner` (see release) */
+static void free_hnsw(const Dataset *owner, Hnsw *graph) {
+    if (graph == NULL) {
+        return;
+    }
+    if (graph->map != NULL) {
+        if (munmap(graph->map, graph->map_len) == -1) {
+            perror("munmap");
+            exit(1);
+        }
+    } else {
+        release(owner, graph->upper_start);
+        release(owner, graph->links0);
+        release(owner, graph->links);
+    }
+    free(graph);
+}
+
+/**
+ * Build a graph over the images of `data`. Levels are drawn from a fixed
+ * pseudo-random sequence, falling off geometrically by a factor of M, and
+ * images are inserted in order.
+ */
+static Hnsw *build_hnsw(const Dataset *data, int M) {
+    Hnsw *graph = alloc_hnsw();
+    graph->M = M;
+    graph->upper_start = malloc(sizeof(int) * (data->num_items + 1));
+    if (graph->upper_start == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int seed = 1;
+    graph->upper_start[0] = 0;
+    for (int i = 0; i < data->num_items; i++) {
+        seed = seed * 1103515245 + 12345;
+        double uniform = ((seed >> 8) + 1.0) / (1 << 24);
+        int level = -log(uniform) / log(M);
+        graph->upper_start[i + 1] = graph->upper_start[i] + level;
+    }
+    int num_upper = graph->upper_start[data->num_items];
+    graph->links0 = calloc((size_t)data->num_items * (1 + 2 * M), sizeof(int));
+    graph->links = calloc((size_t)num_upper * (1 + M) + 1, sizeof(int));
+    Knn_item *found = malloc(sizeof(Knn_item) * HNSW_BUILD_EF);
+    Knn_item *sorted = malloc(sizeof(Knn_item) * HNSW_BUILD_EF);
+    Knn_item *spill = malloc(sizeof(Knn_item) * (2 * M + 1));
+    if (graph->links0 == NULL || graph->links == NULL || found == NULL || sorted == NULL ||
+        spill == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    graph->entry = 0;
+    graph->max_level = graph->upper_start[1];
+    for (int q = 1; q < data->num_items; q++) {
+        hnsw_insert(data, graph, q, found, sorted, spill);
+    }
+    free(found);
+    free(sorted);
+    free(spill);
+    return graph;
+}
+
+/* Offsets of the arrays of a saved graph, and the length of the file */
+static size_t hnsw_offsets(int num_items, int M, int num_upper, size_t offsets[3]) {
+    offsets[0] = ALIGN_UP(sizeof(Hnsw_header), CACHE_LINE);
+    offsets[1] = ALIGN_UP(offsets[0] + sizeof(int) * (num_items + 1), CACHE_LINE);
+    offsets[2] = ALIGN_UP(offsets[1] + sizeof(int) * (size_t)num_items * (1 + 2 * M), CACHE_LINE);
+    return offsets[2] + sizeof(int) * (size_t)num_upper * (1 + M);
+}
+
+/* Return 1 if every row of `count` rows of `links` holds up to `max` links to images */
+static int valid_rows(const int *links, size_t count, int max, int num_items) {
+    for (size_t r = 0; r < count; r++, links += 1 + max) {
+        if (links[0] < 0 || links[0] > max) {
+            return 0;
+        }
+        for (int k = 1; k <= links[0]; k++) {
+            if (links[k] < 0 || links[k] >= num_items) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Return 1 if the arrays of `graph`, read from a file, hold `num_upper` rows
+ * on the upper layers and only links to images, if its entry is an image on
+ * its top level, and if every link of an upper layer leads to an image on
+ * that layer, so the search never reads a row past the links
+ */
+static int valid_graph(const Hnsw *graph, int num_items, int num_upper) {
+    int M = graph->M;
+    const int *start = graph->upper_start;
+    int valid = start[0] == 0 && start[num_items] == num_upper &&
+                graph->entry >= 0 && graph->entry < num_items &&
+                valid_rows(graph->links0, num_items, 2 * M, num_items) &&
+                valid_rows(graph->links, num_upper, M, num_items);
+    for (int i = 0; valid && i < num_items; i++) {
+        valid = start[i] <= start[i + 1] && start[i + 1] - start[i] <= graph->max_level;
+    }
+    valid = valid && start[graph->entry + 1] - start[graph->entry] == graph->max_level;
+    for (int i = 0; valid && i < num_items; i++) {
+        for (int l = 1; valid && l <= start[i + 1] - start[i]; l++) {
+            const int *row = hnsw_row(graph, i, l);
+            for (int k = 1; valid && k <= row[0]; k++) {
+                valid = start[row[k] + 1] - start[row[k]] >= l;
+            }
+        }
+    }
+    return valid;
+}
+
+/**
+ * Map the graph saved in `path` for use in place, or return NULL if there
+ * is none, or it was built with another M or over other images.
+ */
+static Hnsw *load_hnsw(const char *path, int num_items, int M, unsigned long long hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    Hnsw_header header;
+    size_t offsets[3];
+    Hnsw *graph = NULL;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, HNSW_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == HNSW_VERSION && header.num_items == num_items && header.M == M &&
+        header.hash == hash && header.num_upper >= 0 && header.entry >= 0 &&
+        header.entry < num_items && header.max_level >= 0 &&
+        (size_t)st.st_size == hnsw_offsets(num_items, M, header.num_upper, offsets)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        graph = alloc_hnsw();
+        graph->M = M;
+        graph->entry = header.entry;
+        graph->max_level = header.max_level;
+        graph->upper_start = (int *)((char *)map + offsets[0]);
+        graph->links0 = (int *)((char *)map + offsets[1]);
+        graph->links = (int *)((char *)map + offsets[2]);
+        graph->map = map;
+        graph->map_len = st.st_size;
+        if (!valid_graph(graph, num_items, header.num_upper)) {
+            free_hnsw(NULL, graph);
+            graph = NULL;
+        }
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return graph;
+}
+
+/**
+ * Save `graph` to `path` for load_hnsw. Like a saved projection, the file
+ * is only a cache, so failing to write it is reported but not fatal.
+ */
+static void save_hnsw(const char *path, const Hnsw *graph, int num_items,
+                      unsigned long long hash) {
+    static const char zeros[CACHE_LINE];
+    int num_upper = graph->upper_start[num_items];
+    Hnsw_header header = {HNSW_MAGIC, HNSW_VERSION, num_items, graph->M, graph->entry,
+                          graph->max_level, num_upper, 0, hash};
+    size_t offsets[3];
+    hnsw_offsets(num_items, graph->M, num_upper, offsets);
+    size_t links0_len = (size_t)num_items * (1 + 2 * graph->M);
+    size_t links_len = (size_t)num_upper * (1 + graph->M);
+    size_t upper_end = offsets[0] + sizeof(int) * (num_items + 1);
+    size_t links0_end = offsets[1] + sizeof(int) * links0_len;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(zeros, 1, offsets[0] - sizeof(header), file) != offsets[0] - sizeof(header) ||
+        fwrite(graph->upper_start, sizeof(int), num_items + 1, file) != num_items + 1 ||
+        fwrite(zeros, 1, offsets[1] - upper_end, file) != offsets[1] - upper_end ||
+        fwrite(graph->links0, sizeof(int), links0_len, file) != links0_len ||
+        fwrite(zeros, 1, offsets[2] - links0_end, file) != offsets[2] - links0_end ||
+        fwrite(graph->links, sizeof(int), links_len, file) != links_len ||
+        fclose(file) == EOF) {
+        fprintf(stderr, "Warning: could not save the graph to %s\n", path);
+        remove(path);
+    }
+}
+
+/**
+ * hnsw_training builds a hierarchical navigable small world graph (HNSW)
+ * over a training set, linking every image to up to M images near it in
+ * euclidean distance (2 M on the bottom layer), on the bottom layer and on
+ * sparser layers above it. knn_predict then walks the graph towards the
+ * query and keeps the `ef` nearest images it meets, raised to K if needed,
+ * which it ranks under the metric like a shortlist (see binarize_training),
+ * so the label vote is unchanged. A search only touches a few thousand
+ * images, however big the training set, but it can miss neighbors: larger
+ * M and ef miss fewer, at the cost of a bigger graph and a slower search.
  *
- *     -   4 bytes : `N`: Number of images / labels in the file
- *     -   1 byte  : Image 1 label
- *     - 784 bytes : Image 1 data (WIDTHxWIDTH)
- *          ...
- *     -   1 byte  : Image N label
- *     - 784 bytes : Image N data (WIDTHxWIDTH)
+ * Building inserts the images one at a time, each with a search keeping
+ * HNSW_BUILD_EF images, so if `cache_file` is not NULL the graph is saved
+ * there, and later runs map that file and search it in place, as long as
+ * it was built with the same M over the same images.
  *
- * If the filename does not exist then the function will return a NULL pointer.
+ * A graph read from an index (see map_index) is kept as it is and only
+ * searched with the new ef, and asking for another M is an error.
+ *
+ * The graph works on the stored pixels, so call it after prepare_training.
+ * It takes precedence over every search but the shortlists.
  */
-Dataset *load_dataset(const char *filename) {
-    Dataset *data = malloc(sizeof(Dataset));
+void hnsw_training(Dataset *data, int M, int ef, const char *cache_file) {
+    if (data->num_items == 0) {
+        return;
+    }
+    if (M < 2) {
+        fprintf(stderr, "Error: expected M of at least 2\n");
+        exit(1);
+    }
+    if (ef < 1) {
+        fprintf(stderr, "Error: expected ef of at least 1\n");
+        exit(1);
+    }
+    if (data->hnsw != NULL) {
+        if (M != data->hnsw->M) {
+            fprintf(stderr, "Error: the training set already has a graph with M = %d\n",
+                    data->hnsw->M);
+            exit(1);
+        }
+        data->hnsw->ef = ef;
+        return;
+    }
+    unsigned long long hash = hash_images(data);
+    Hnsw *graph = cache_file != NULL ? load_hnsw(cache_file, data->num_items, M, hash) : NULL;
+    if (graph == NULL) {
+        graph = build_hnsw(data, M);
+        if (cache_file != NULL) {
+            save_hnsw(cache_file, graph, data->num_items, hash);
+        }
+        free_knn_scratch();
+    }
+    graph->ef = ef;
+    data->hnsw = graph;
+}
 
-    FILE *f = fopen(filename, "rb");
-    if(f == NULL) {
-        return NULL;
+/**
+ * Return a 64-bit FNV-1a hash of the contents of the dataset file
+ * `filename`, which identifies the training set an index was built from.
+ */
+unsigned long long dataset_hash(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        exit(1);
     }
-    if(fread(&data->num_items, sizeof(int), 1, f)==-1){
-        fprintf(stderr, "Could not read num items from %s\n", filename);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    unsigned long long h = 14695981039346656037ULL;
+    if (st.st_size > 0) {
+        unsigned char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise(file, st.st_size, MADV_SEQUENTIAL);
+        for (off_t i = 0; i < st.st_size; i++) {
+            h = (h ^ file[i]) * 1099511628211ULL;
+        }
+        if (munmap(file, st.st_size) == -1) {
+            perror("munmap");
+            exit(1);
+        }
+    }
+    if (close(fd) == -1) {
+        perror("close");
         exit(1);
     }
+    return h;
+}
 
-    data->labels = malloc(sizeof(unsigned char) * data->num_items);
-    data->images = malloc(sizeof(Image) * data->num_items);
+/**
+ * Fill in the length in bytes of every array of an index with header `h`,
+ * and its offset in the file, and return the length of the file.
+ */
+static size_t index_layout(const Index_header *h, size_t lengths[INDEX_ARRAYS],
+                           size_t offsets[INDEX_ARRAYS]) {
+    size_t items = h->num_items;
+    lengths[INDEX_LABELS] = items;
+    lengths[INDEX_NORMS] = sizeof(double) * items;
+    lengths[INDEX_SQ_NORMS] = sizeof(unsigned int) * items;
+    lengths[INDEX_PIXEL_ORDER] = sizeof(int) * h->sx * h->sy;
+    lengths[INDEX_PIXELS] = items * h->stride;
+    lengths[INDEX_BLOCK_SUMS] = sizeof(unsigned short) * items * h->sums_stride;
+    lengths[INDEX_SPARSE_START] = h->sparse ? sizeof(size_t) * (items + 1) : 0;
+    lengths[INDEX_SPARSE_INDEX] = h->sparse ? sizeof(unsigned short) * h->nnz : 0;
+    lengths[INDEX_SPARSE_VALUES] = h->sparse ? h->nnz : 0;
+    lengths[INDEX_PIVOTS] = sizeof(int) * h->num_pivots;
+    lengths[INDEX_PIVOT_DISTS] = sizeof(float) * items * h->pivot_stride;
+    lengths[INDEX_UPPER_START] = h->M > 0 ? sizeof(int) * (items + 1) : 0;
+    lengths[INDEX_LINKS0] = h->M > 0 ? sizeof(int) * items * (1 + 2 * (size_t)h->M) : 0;
+    lengths[INDEX_LINKS] = h->M > 0 ? sizeof(int) * h->num_upper * (1 + (size_t)h->M) : 0;
+    lengths[INDEX_VP_ORDER] = h->vp_leaf > 0 ? sizeof(int) * items : 0;
+    lengths[INDEX_VP_BOUNDS] = h->vp_leaf > 0 ? sizeof(float) * 4 * items : 0;
+    size_t dims = ALIGN_UP(h->components, FLOAT_ALIGN);
+    lengths[INDEX_PCA_OFFSET] = sizeof(float) * dims;
+    lengths[INDEX_PCA_AXES] = sizeof(float) * h->num_pixels * dims;
+    lengths[INDEX_PROJECTED] = sizeof(float) * items * dims;
+    size_t cells = h->num_cells;
+    size_t subspaces = cells > 0 ? ivf_subspaces(h->num_pixels) : 0;
+    lengths[INDEX_IVF_CENTROIDS] = cells * h->stride;
+    lengths[INDEX_IVF_CODEBOOKS] = sizeof(float) * subspaces * PQ_DIMS * PQ_CODES;
+    lengths[INDEX_IVF_CELL_TERMS] = sizeof(float) * cells * subspaces * PQ_CODES;
+    lengths[INDEX_IVF_CELL_START] = cells > 0 ? sizeof(int) * (cells + 1) : 0;
+    lengths[INDEX_IVF_IDS] = sizeof(int) * PQ_BLOCK * (size_t)h->num_blocks;
+    lengths[INDEX_IVF_CODES] = 16 * subspaces * h->num_blocks;
+    size_t end = sizeof(Index_header);
+    for (int a = 0; a < INDEX_ARRAYS; a++) {
+        offsets[a] = ALIGN_UP(end, CACHE_LINE);
+        end = offsets[a] + lengths[a];
+    }
+    return end;
+}
 
-    for (int i = 0; i < data->num_items; i++) {
-        if(fread(data->labels + i, sizeof(unsigned char), 1, f) != 1) {
-            fprintf(stderr, "Error: expecting to read a label from %s\n", filename);
+/**
+ * write_index saves a prepared training set to `filename` as an index file,
+ * which load_dataset maps and searches in place, with no preprocessing. It
+ * holds the stored pixels, labels, norms and pixel order, the block sums
+ * and nonzero pixel lists of the metrics' precompute hooks, and the pivot
+ * table, graph, vantage-point tree, projection and inverted file if there
+ * are any (see pivot_training, hnsw_training, vp_tree_training,
+ * project_training and ivf_training), each array starting on a cache line.
+ * Only the copy of the images in tree order is not stored, as it takes as
+ * much room as the pixels and map_index rebuilds it with one pass of
+ * copies. The 1-bit copy of binarize_training is not stored either, being
+ * quicker to compute than to read. The header records INDEX_VERSION, so
+ * indexes of another layout are rejected, and the `hash` of the training
+ * file (see dataset_hash).
+ *
+ * Unlike the caches saved next to a training file, the index is what the
+ * caller asked for, so failing to write it is fatal.
+ */
+void write_index(const Dataset *data, unsigned long long hash, const char *filename) {
+    static const char zeros[CACHE_LINE];
+    const Hnsw *graph = data->hnsw;
+    Index_header header = {INDEX_MAGIC, INDEX_VERSION, data->num_items, data->sx, data->sy,
+                           data->num_pixels, ALIGN_UP(data->num_pixels, CACHE_LINE), 0};
+    header.sums_stride = data->block_sums != NULL ? data->sums_stride : 0;
+    header.sparse = data->sparse_start != NULL;
+    header.density = header.sparse ? data->density : 0;
+    header.nnz = header.sparse ? data->sparse_start[data->num_items] : 0;
+    header.num_pivots = data->num_pivots;
+    header.pivot_stride = data->pivots != NULL ? data->pivot_stride : 0;
+    if (graph != NULL) {
+        header.M = graph->M;
+        header.ef = graph->ef;
+        header.entry = graph->entry;
+        header.max_level = graph->max_level;
+        header.num_upper = graph->upper_start[data->num_items];
+    }
+    const Vp_tree *tree = data->vp_tree;
+    header.vp_leaf = tree != NULL ? VP_LEAF : 0;
+    const Projection *pca = data->projected != NULL ? data->projection : NULL;
+    const Ivf *ivf = data->ivf;
+    if (pca != NULL || ivf != NULL) {
+        header.shortlist = data->shortlist;
+    }
+    if (pca != NULL) {
+        header.components = pca->components;
+    }
+    if (ivf != NULL) {
+        header.num_cells = ivf->num_cells;
+        header.nprobe = ivf->nprobe;
+        header.num_blocks = ivf->cell_start[ivf->num_cells];
+    }
+    header.hash = hash;
+
+    // Datasets whose pixels are in raster order get the identity order
+    int n = data->sx * data->sy;
+    int *pixel_order = malloc(sizeof(int) * n);
+    if (pixel_order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int p = 0; p < n; p++) {
+        pixel_order[p] = data->pixel_order != NULL ? data->pixel_order[p] : p;
+    }
+    const void *arrays[INDEX_ARRAYS] = {
+        data->labels, data->norms, data->sq_norms, pixel_order, data->pixels,
+        data->block_sums, data->sparse_start, data->sparse_index, data->sparse_values,
+        data->pivots, data->pivot_dists, graph != NULL ? graph->upper_start : NULL,
+        graph != NULL ? graph->links0 : NULL, graph != NULL ? graph->links : NULL,
+        tree != NULL ? tree->order : NULL, tree != NULL ? tree->bounds : NULL,
+        pca != NULL ? pca->offset : NULL, pca != NULL ? pca->axes : NULL, data->projected,
+        ivf != NULL ? ivf->centroids : NULL, ivf != NULL ? ivf->codebooks : NULL,
+        ivf != NULL ? ivf->cell_terms : NULL, ivf != NULL ? ivf->cell_start : NULL,
+        ivf != NULL ? ivf->ids : NULL, ivf != NULL ? ivf->codes : NULL
+    };
+    size_t lengths[INDEX_ARRAYS], offsets[INDEX_ARRAYS];
+    index_layout(&header, lengths, offsets);
+
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    size_t end = sizeof(header);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int a = 0; ok && a < INDEX_ARRAYS; a++) {
+        ok = fwrite(zeros, 1, offsets[a] - end, file) == offsets[a] - end;
+        if (ok && a == INDEX_PIXELS) {
+            // Image by image, as a mapped dataset has other strides
+            size_t padding = header.stride - data->num_pixels;
+            Image img = dataset_image(data, 0);
+            for (int i = 0; ok && i < data->num_items; i++, img.data += data->stride) {
+                ok = fwrite(img.data, 1, data->num_pixels, file) == (size_t)data->num_pixels &&
+                     fwrite(zeros, 1, padding, file) == padding;
+            }
+        } else if (ok && lengths[a] > 0) {
+            ok = fwrite(arrays[a], 1, lengths[a], file) == lengths[a];
+        }
+        end = offsets[a] + lengths[a];
+    }
+    if (!ok || fclose(file) == EOF) {
+        fprintf(stderr, "Error: could not write the index to %s\n", filename);
+        remove(filename);
+        exit(1);
+    }
+    free(pixel_order);
+}
+
+/* Return 1 if the fields of an index header describe a dataset this build can search */
+static int valid_index_header(const Index_header *h) {
+    if (h->num_items < 0 || h->sx <= 0 || h->sy <= 0 || h->sx > MAX_PIXELS / h->sy ||
+        h->num_pixels < 1 || h->num_pixels > h->sx * h->sy ||
+        h->stride != (int)ALIGN_UP(h->num_pixels, CACHE_LINE)) {
+        return 0;
+    }
+    int blocks = h->sx % 4 == 0 && h->sy % 4 == 0;
+    if (h->sums_stride != 0 &&
+        (!blocks || h->sums_stride != (int)ALIGN_UP(h->sx / 4 * (h->sy / 4), SUMS_ALIGN))) {
+        return 0;
+    }
+    if ((h->sparse != 0 && h->sparse != 1) || (h->sparse && h->num_pixels > USHRT_MAX + 1) ||
+        h->nnz > (unsigned long long)h->num_items * h->num_pixels) {
+        return 0;
+    }
+    if (h->num_pivots < 0 || h->num_pivots > h->num_items ||
+        h->pivot_stride != (h->num_pivots > 0 ? (int)ALIGN_UP(h->num_pivots, FLOAT_ALIGN) : 0)) {
+        return 0;
+    }
+    if ((h->vp_leaf != 0 && h->vp_leaf != VP_LEAF) || h->components < 0 ||
+        h->components > h->num_pixels || (h->components > 0 && h->num_cells != 0) ||
+        (h->components > 0 || h->num_cells != 0 ? h->shortlist < 1 : h->shortlist != 0)) {
+        return 0;
+    }
+    if (h->num_cells == 0 ? h->nprobe != 0 || h->num_blocks != 0 :
+        h->num_cells < 0 || h->num_cells > h->num_items || h->nprobe < 1 ||
+        h->nprobe > h->num_cells || h->num_blocks < 0 || h->num_blocks > h->num_items) {
+        return 0;
+    }
+    if (h->M == 0) {
+        return h->num_upper == 0;
+    }
+    return h->M >= 2 && h->M < INT_MAX / 4 && h->ef >= 1 && h->entry >= 0 &&
+           h->entry < h->num_items && h->max_level >= 0 && h->max_level <= h->num_upper &&
+           h->num_upper <= h->num_items * (long long)h->max_level;
+}
+
+/*
+ * Return 1 if the arrays of a dataset read from an index with header `h`
+ * only point at its own entries
+ */
+static int valid_index_arrays(const Dataset *data, const Index_header *h) {
+    unsigned long long nnz = h->nnz;
+    int n = data->sx * data->sy;
+    for (int p = 0; p < n; p++) {
+        if (data->pixel_order[p] < 0 || data->pixel_order[p] >= n) {
+            return 0;
+        }
+    }
+    if (data->sparse_start != NULL) {
+        if (data->sparse_start[0] != 0 || data->sparse_start[data->num_items] != nnz) {
+            return 0;
+        }
+        for (int i = 0; i < data->num_items; i++) {
+            if (data->sparse_start[i] > data->sparse_start[i + 1]) {
+                return 0;
+            }
+        }
+        for (size_t k = 0; k < nnz; k++) {
+            if (data->sparse_index[k] >= data->num_pixels) {
+                return 0;
+            }
+        }
+    }
+    for (int p = 0; p < data->num_pivots; p++) {
+        if (data->pivots[p] < 0 || data->pivots[p] >= data->num_items) {
+            return 0;
+        }
+    }
+    for (int j = 0; data->vp_tree != NULL && j < data->num_items; j++) {
+        if (data->vp_tree->order[j] < 0 || data->vp_tree->order[j] >= data->num_items) {
+            return 0;
+        }
+    }
+    const Ivf *ivf = data->ivf;
+    if (ivf != NULL) {
+        if (ivf->cell_start[0] != 0 || ivf->cell_start[ivf->num_cells] != h->num_blocks) {
+            return 0;
+        }
+        for (int c = 0; c < ivf->num_cells; c++) {
+            if (ivf->cell_start[c] > ivf->cell_start[c + 1]) {
+                return 0;
+            }
+        }
+        for (size_t j = 0; j < (size_t)PQ_BLOCK * h->num_blocks; j++) {
+            if (ivf->ids[j] < -1 || ivf->ids[j] >= data->num_items) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * map_index maps an index file written by write_index, and returns the
+ * training set it holds, ready to search: its arrays point straight into
+ * the mapping, which is placed right after the Dataset struct like the
+ * records of map_dataset, so free_dataset releases both with one munmap.
+ * Only the header, the indexes stored in the arrays and the levels of the
+ * graph (see valid_graph) are checked, so that corrupt files cannot make
+ * the search read out of bounds. The copy of the images in tree order of a
+ * vantage-point tree is the one part rebuilt here (see write_index).
+ *
+ * If the file does not exist or is not an index, the function returns a
+ * NULL pointer. Indexes of another INDEX_VERSION, or that do not add up,
+ * are errors.
+ */
+Dataset *map_index(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    Index_header h;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) != 0) {
+        if (close(fd) == -1) {
+            perror("close");
             exit(1);
         }
-        data->images[i].sx = WIDTH;
-        data->images[i].sy = WIDTH;
+        return NULL;
+    }
+    if (h.version != INDEX_VERSION) {
+        fprintf(stderr, "Error: %s is an index of version %d, expected %d\n", filename,
+                h.version, INDEX_VERSION);
+        exit(1);
+    }
+    size_t lengths[INDEX_ARRAYS], offsets[INDEX_ARRAYS];
+    if (!valid_index_header(&h) || (size_t)st.st_size != index_layout(&h, lengths, offsets)) {
+        fprintf(stderr, "Error: %s is not a valid index\n", filename);
+        exit(1);
+    }
 
-        data->images[i].data = malloc(sizeof(unsigned char) * NUM_PIXELS);
-        if(fread(data->images[i].data, sizeof(unsigned char), NUM_PIXELS, f) != NUM_PIXELS) {
-            fprintf(stderr, "Error: expecting to read the pixels from image %d\n", i);
+    // Reserve room for the struct followed by the file, then map the file
+    // over the tail of the reservation, private like map_dataset
+    File_layout layout = {h.num_items, h.sx, h.sy, sizeof(h), 0};
+    Dataset *data = alloc_dataset(&layout, 0, sysconf(_SC_PAGESIZE), st.st_size);
+    char *file = mmap(data->pixels, st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    data->num_items = h.num_items;
+    data->num_pixels = h.num_pixels;
+    data->kernels = kernels_for_size(h.num_pixels);
+    data->stride = h.stride;
+    data->labels = (unsigned char *)(file + offsets[INDEX_LABELS]);
+    data->norms = (double *)(file + offsets[INDEX_NORMS]);
+    data->sq_norms = (unsigned int *)(file + offsets[INDEX_SQ_NORMS]);
+    data->pixel_order = (int *)(file + offsets[INDEX_PIXEL_ORDER]);
+    data->pixels = (unsigned char *)(file + offsets[INDEX_PIXELS]);
+    if (h.sums_stride > 0) {
+        data->sums_stride = h.sums_stride;
+        data->block_sums = (unsigned short *)(file + offsets[INDEX_BLOCK_SUMS]);
+    }
+    if (h.sparse) {
+        data->density = h.density;
+        data->sparse_start = (size_t *)(file + offsets[INDEX_SPARSE_START]);
+        data->sparse_index = (unsigned short *)(file + offsets[INDEX_SPARSE_INDEX]);
+        data->sparse_values = (unsigned char *)(file + offsets[INDEX_SPARSE_VALUES]);
+    }
+    if (h.num_pivots > 0) {
+        data->num_pivots = h.num_pivots;
+        data->pivot_stride = h.pivot_stride;
+        data->pivots = (int *)(file + offsets[INDEX_PIVOTS]);
+        data->pivot_dists = (float *)(file + offsets[INDEX_PIVOT_DISTS]);
+    }
+    if (h.vp_leaf > 0) {
+        Vp_tree *tree = calloc(1, sizeof(Vp_tree));
+        if (tree == NULL) {
+            perror("calloc");
             exit(1);
         }
+        tree->order = (int *)(file + offsets[INDEX_VP_ORDER]);
+        tree->bounds = (float *)(file + offsets[INDEX_VP_BOUNDS]);
+        data->vp_tree = tree;
     }
-    if(fclose(f) != 0) {
-        perror("fclose");
+    if (h.components > 0) {
+        Projection *pca = calloc(1, sizeof(Projection));
+        if (pca == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        pca->pixels = h.num_pixels;
+        pca->components = h.components;
+        pca->dims = ALIGN_UP(h.components, FLOAT_ALIGN);
+        pca->offset = (float *)(file + offsets[INDEX_PCA_OFFSET]);
+        pca->axes = (float *)(file + offsets[INDEX_PCA_AXES]);
+        data->projection = pca;
+        data->projected = (float *)(file + offsets[INDEX_PROJECTED]);
+    }
+    if (h.num_cells > 0) {
+        Ivf *ivf = calloc(1, sizeof(Ivf));
+        if (ivf == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        ivf->num_cells = h.num_cells;
+        ivf->nprobe = h.nprobe;
+        ivf->subspaces = ivf_subspaces(h.num_pixels);
+        ivf->centroids = (unsigned char *)(file + offsets[INDEX_IVF_CENTROIDS]);
+        ivf->codebooks = (float *)(file + offsets[INDEX_IVF_CODEBOOKS]);
+        ivf->cell_terms = (float *)(file + offsets[INDEX_IVF_CELL_TERMS]);
+        ivf->cell_start = (int *)(file + offsets[INDEX_IVF_CELL_START]);
+        ivf->ids = (int *)(file + offsets[INDEX_IVF_IDS]);
+        ivf->codes = (unsigned char *)(file + offsets[INDEX_IVF_CODES]);
+        data->ivf = ivf;
+    }
+    data->shortlist = h.shortlist;
+    int valid = valid_index_arrays(data, &h);
+    if (h.M > 0) {
+        Hnsw *graph = alloc_hnsw();
+        graph->M = h.M;
+        graph->ef = h.ef;
+        graph->entry = h.entry;
+        graph->max_level = h.max_level;
+        graph->upper_start = (int *)(file + offsets[INDEX_UPPER_START]);
+        graph->links0 = (int *)(file + offsets[INDEX_LINKS0]);
+        graph->links = (int *)(file + offsets[INDEX_LINKS]);
+        data->hnsw = graph;
+        valid = valid && valid_graph(graph, h.num_items, h.num_upper);
+    }
+    if (!valid) {
+        fprintf(stderr, "Error: %s is not a valid index\n", filename);
         exit(1);
     }
+    if (data->vp_tree != NULL) {
+        data->vp_tree->images = reordered_copy(data, data->vp_tree->order);
+    }
     return data;
 }
 
-
-/** 
- * Return the euclidean distance between the image pixels (as vectors).
- * Specifically  d = sqrt( sum((a[i]-b[i])^2))
+/**
+ * Search of a dataset with a graph (see hnsw_training): collect the ef
+ * images nearest to the query that the graph search meets, then rank them
+ * under the metric, nearest first so the bound tightens early.
  */
-double distance_euclidean(Image *a, Image *b) {
-    double d = 0;
-    for (int i = 0; i < a->sx * a->sy; i++) {
-        d += (a->data[i] - b->data[i]) * (a->data[i] - b->data[i]);
+static int hnsw_neighbors(Dataset *data, const Query *query, int K,
+                          const Metric *metric, Knn_item *smallest) {
+    const Hnsw *graph = data->hnsw;
+    int ef = graph->ef > K ? graph->ef : K;
+    Knn_heap found = {grow_scratch(SHORTLIST_SCRATCH, sizeof(Knn_item) * ef)};
+    hnsw_descend(data, graph, query->pixels, 0, ef, &found);
+    hnsw_search_layer(data, graph, query->pixels, 0, &found);
+    qsort(found.items, found.size, sizeof(Knn_item), compare_knn_items);
+
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+    for (int c = 0; c < found.size; c++) {
+        int i = found.items[c].img_idx;
+        double key;
+        metric->score(data, query, i, i + 1, heap.bound, &key);
+        heap_offer(&heap, key, i);
     }
-    return sqrt(d);
+    return heap.size;
 }
 
-typedef struct {
-    double dist;
-    int img_idx;
-} Knn_item;
-
 /**
- * Given the input training dataset, an image to classify and K as well as a 
- * distance function specified by fptr,
- *   (1) Find the K most similar images to `input` in the dataset
- *   (2) Return the most frequent label of these K images.  If two are tied, 
- *       output the smaller label.
- */ 
-int knn_predict(Dataset *data, Image *input, int K, double (*fptr)(Image *, Image *)) {
+ * Search of a dataset with an inverted file (see ivf_training): collect the
+ * K * shortlist images of the probed cells with the nearest approximate
+ * distances to the query, then rank only those under the metric, nearest
+ * first so the bound tightens early.
+ *
+ * The distance tables of a cell are quantized to bytes with one scale for
+ * every subspace, small enough that the sums of pq_scan fit in 16 bits,
+ * after taking out the smallest entry of each subspace, which is added back
+ * to the sums.
+ */
+static int ivf_neighbors(Dataset *data, const Query *query, int K,
+                         const Metric *metric, Knn_item *smallest) {
+    const Ivf *ivf = data->ivf;
+    int n = data->num_pixels;
+    size_t stride = ALIGN_UP(n, CACHE_LINE);
+    int subspaces = ivf->subspaces;
+    int top = 65535 / subspaces < 255 ? 65535 / subspaces : 255;
 
-    // Array to keep track of K-closest images so far.
-    Knn_item smallest[K];
-    for (int i = 0; i < K; i++) {
-        smallest[i].dist = INFINITY;
+    Knn_item *probes = grow_scratch(IVF_PROBES_SCRATCH, sizeof(Knn_item) * ivf->nprobe);
+    Knn_heap cells;
+    heap_init(&cells, probes, ivf->nprobe);
+    for (int c = 0; c < ivf->num_cells; c++) {
+        heap_offer(&cells, data->kernels->sq_diff(ivf->centroids + c * stride, query->pixels, n), c);
     }
-    // For each training image, compute the distance using the function pointer
-    for (int i = 0; i < data->num_items; i++) {
-        
-        // TODO Change the call below to call distance function passed in as
-        // a parameter
-        double dist = fptr(&data->images[i], input);
+    // Nearest cells first, so the shortlist's bound soon rejects most images
+    qsort(probes, cells.size, sizeof(Knn_item), compare_knn_items);
+
+    int len = (long long)K * data->shortlist < data->num_items ? K * data->shortlist : data->num_items;
+    Knn_item *candidates = grow_scratch(SHORTLIST_SCRATCH, sizeof(Knn_item) * len);
+    Knn_heap coarse;
+    heap_init(&coarse, candidates, len);
+    // |q - c - y|^2 = |q - c|^2 + (|y|^2 + 2 c.y) - 2 q.y: the middle term is
+    // stored per cell, and the last one is computed once here
+    float *query_terms =
+        grow_scratch(QUERY_TERMS_SCRATCH, sizeof(float) * 2 * subspaces * PQ_CODES);
+    float *dists = query_terms + subspaces * PQ_CODES;
+    for (int s = 0; s * PQ_DIMS < n; s++) {
+        float x[PQ_DIMS];
+        float *terms = query_terms + s * PQ_CODES;
+        pq_slice(query->pixels, n, s, x);
+        pq_products(ivf->codebooks + (size_t)s * PQ_DIMS * PQ_CODES, x, terms);
+        for (int k = 0; k < PQ_CODES; k++) {
+            terms[k] *= -2;
+        }
+    }
+    unsigned char *luts = grow_scratch(QUERY_LUTS_SCRATCH, subspaces * PQ_CODES);
+    memset(luts, 0, subspaces * PQ_CODES);
+    for (int p = 0; p < cells.size; p++) {
+        int c = probes[p].img_idx;
+        const float *cell_terms = ivf->cell_terms + (size_t)c * subspaces * PQ_CODES;
+        double base = probes[p].dist;
+        float widest = 0;
+        for (int s = 0; s * PQ_DIMS < n; s++) {
+            float *d = dists + s * PQ_CODES;
+            for (int k = 0; k < PQ_CODES; k++) {
+                d[k] = cell_terms[s * PQ_CODES + k] + query_terms[s * PQ_CODES + k];
+            }
+            float least = d[0], most = d[0];
+            for (int k = 1; k < PQ_CODES; k++) {
+                least = d[k] < least ? d[k] : least;
+                most = d[k] > most ? d[k] : most;
+            }
+            for (int k = 0; k < PQ_CODES; k++) {
+                d[k] -= least;
+            }
+            base += least;
+            widest = most - least > widest ? most - least : widest;
+        }
+        float scale = widest > 0 ? top / widest : 1;
+        for (int s = 0; s * PQ_DIMS < n; s++) {
+            for (int k = 0; k < PQ_CODES; k++) {
+                luts[s * PQ_CODES + k] = dists[s * PQ_CODES + k] * scale + 0.5f;
+            }
+        }
 
-        // Find the maximum distance among the previous K closest
-        double max_dist = -1;
-        int max_index = 0;
-        for (int j = 0; j < K; j++) {
-            if (smallest[j].dist > max_dist) {
-                max_dist = smallest[j].dist;
-                max_index = j;
+        unsigned short approx[PQ_BLOCK];
+        for (int b = ivf->cell_start[c]; b < ivf->cell_start[c + 1]; b++) {
+            data->kernels->pq_scan(ivf->codes + (size_t)b * 16 * subspaces, luts, subspaces, approx);
+            const int *ids = ivf->ids + b * PQ_BLOCK;
+            for (int j = 0; j < PQ_BLOCK && ids[j] >= 0; j++) {
+                heap_offer(&coarse, base + approx[j] / scale, ids[j]);
             }
         }
+    }
+    qsort(candidates, coarse.size, sizeof(Knn_item), compare_knn_items);
+
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+    for (int c = 0; c < coarse.size; c++) {
+        int i = candidates[c].img_idx;
+        double key;
+        metric->score(data, query, i, i + 1, heap.bound, &key);
+        heap_offer(&heap, key, i);
+    }
+    return heap.size;
+}
+
+/**
+ * Fill `smallest` with the K images of `data` that rank closest to `input`
+ * (given in raster order, whatever the layout of `data`)
+ * and return how many were found (fewer than K only if the dataset is
+ * smaller), in the first slots and in no particular order. The `dist` fields
+ * hold rank keys, not distances. Ties are broken by the lower image index.
+ */
+static int find_neighbors(Dataset *data, Image *input, int K,
+                          const Metric *metric, Knn_item *smallest) {
+    // No image is a neighbor, and the shortlists would have no room to sort
+    if (K < 1) {
+        return 0;
+    }
+    int n = data->sx * data->sy;
+    Query query = {input->data, 0, 0, 0, NULL, NULL};
+    if (data->pixel_order != NULL) {
+        // Put the query's pixels in the same order as the training images,
+        // with room for the 32-bit gathers of the sparse dot products
+        size_t len = ALIGN_UP(n, CACHE_LINE) + sizeof(int);
+        unsigned char *pixels = grow_scratch(QUERY_SCRATCH, len);
+        for (int p = 0; p < n; p++) {
+            pixels[p] = input->data[data->pixel_order[p]];
+        }
+        memset(pixels + n, 0, len - n);
+        query.pixels = pixels;
+    }
+    query.sq_norm = kernels.dot(query.pixels, query.pixels, n);
+    for (int p = data->num_pixels; p < n; p++) {
+        query.dropped_sq += query.pixels[p] * query.pixels[p];
+        query.dropped_sum += query.pixels[p];
+    }
+    if (data->block_sums != NULL) {
+        unsigned short *sums =
+            grow_scratch(QUERY_SUMS_SCRATCH, sizeof(unsigned short) * data->sums_stride);
+        block_sums(data, input->data, NULL, n, sums);
+        query.block_sums = sums;
+    }
+    if (data->pivots != NULL) {
+        float *dists = grow_scratch(QUERY_PIVOTS_SCRATCH, sizeof(float) * data->pivot_stride);
+        memset(dists, 0, sizeof(float) * data->pivot_stride);
+        for (int p = 0; p < data->num_pivots; p++) {
+            const unsigned char *pivot = data->pixels + (size_t)data->pivots[p] * data->stride;
+            dists[p] = sqrt(data->kernels->sq_diff(pivot, query.pixels, data->num_pixels) +
+                            query.dropped_sq);
+        }
+        query.pivot_dists = dists;
+    }
+    if (uses_shortlist(data)) {
+        return shortlist_neighbors(data, &query, K, metric, smallest);
+    }
+    if (data->hnsw != NULL) {
+        return hnsw_neighbors(data, &query, K, metric, smallest);
+    }
+    if (data->ivf != NULL) {
+        return ivf_neighbors(data, &query, K, metric, smallest);
+    }
+    if (data->vp_tree != NULL && metric->norm_bound != NULL) {
+        return vp_tree_neighbors(data, &query, K, metric, smallest);
+    }
+    if (data->by_norm != NULL && metric->norm_bound != NULL) {
+        return norm_neighbors(data, &query, K, metric, smallest);
+    }
+    Knn_heap heap;
+    heap_init(&heap, smallest, K);
+
+    // Score a block of training images at a time against the current bound.
+    // The bound only shrinks, so keys the metric left above it are still
+    // rejected when the block is offered to the heap.
+    double keys[SCORE_BLOCK];
+    for (int b = 0; b < data->num_items; b += SCORE_BLOCK) {
+        int end = data->num_items - b < SCORE_BLOCK ? data->num_items : b + SCORE_BLOCK;
+        metric->score(data, &query, b, end, heap.bound, keys);
+        for (int i = b; i < end; i++) {
+            heap_offer(&heap, keys[i - b], i);
+        }
+    }
+    return heap.size;
+}
+
+/**
+ * Store the K images of `data` closest to `input` under `metric` in
+ * `neighbors`, sorted by increasing distance, and return how many were
+ * stored. Unlike knn_predict, the real distances are reported, but they are
+ * only computed for these K images.
+ */
+int knn_neighbors(Dataset *data, Image *input, int K,
+                  const Metric *metric, Knn_item *neighbors) {
+    int found = find_neighbors(data, input, K, metric, neighbors);
+
+    qsort(neighbors, found, sizeof(Knn_item), compare_knn_items);
+    Image query = *input;
+    if (data->pixel_order != NULL) {
+        query.data = scratches[QUERY_SCRATCH].buf;  // left rearranged by find_neighbors
+    }
+    // Training images are copied out whole, with their blank dropped pixels
+    int n = data->sx * data->sy;
+    unsigned char *whole = NULL;
+    if (data->num_pixels < n) {
+        whole = grow_scratch(TRAIN_SCRATCH, n);
+        memset(whole + data->num_pixels, 0, n - data->num_pixels);
+    }
+    for (int i = 0; i < found; i++) {
+        Image train = dataset_image(data, neighbors[i].img_idx);
+        if (whole != NULL) {
+            memcpy(whole, train.data, data->num_pixels);
+            train.data = whole;
+        }
+        neighbors[i].dist = metric->distance(&train, &query);
+    }
+    return found;
+}
 
-        // If current distance one of K-closest so far, update the values.
-        if (dist < max_dist) {
-            smallest[max_index].dist = dist;
-            smallest[max_index].img_idx = i;
-        }    
+/**
+ * Return how many images of `queries` get other neighbors from the
+ * vantage-point tree of `data` than from a plain scan of every image, which
+ * should be none, as a check of the tree or of a copy of it read from a file.
+ * The tree must be what the search of `data` uses, with no shortlist, graph
+ * or inverted file taking precedence, and a metric with a norm_bound.
+ */
+int vp_tree_mismatches(Dataset *data, Dataset *queries, int K, const Metric *metric) {
+    if (K < 1) {
+        return 0;
+    }
+    // A plain scan of every image, without any index or bound
+    Dataset exhaustive = *data;
+    exhaustive.vp_tree = NULL;
+    exhaustive.by_norm = NULL;
+    exhaustive.hnsw = NULL;
+    exhaustive.ivf = NULL;
+    exhaustive.shortlist = 0;
+    exhaustive.pivots = NULL;
+    exhaustive.block_sums = NULL;
+    Knn_item *found = malloc(sizeof(Knn_item) * K);
+    Knn_item *expected = malloc(sizeof(Knn_item) * K);
+    if (found == NULL || expected == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int mismatches = 0;
+    for (int q = 0; q < queries->num_items; q++) {
+        Image query = dataset_image(queries, q);
+        int count = knn_neighbors(data, &query, K, metric, found);
+        int differs = knn_neighbors(&exhaustive, &query, K, metric, expected) != count;
+        for (int i = 0; !differs && i < count; i++) {
+            differs = found[i].img_idx != expected[i].img_idx || found[i].dist != expected[i].dist;
+        }
+        mismatches += differs;
     }
+    free(found);
+    free(expected);
+    free_knn_scratch();
+    return mismatches;
+}
 
+/**
+ * Return the most frequent label among the `found` neighbors in `smallest`.
+ * If two are tied, return the smaller label.
+ */
+static int majority_label(Dataset *data, Knn_item *smallest, int found) {
     // Count the frequencies of the labels
     int counts[10] = {0};
-    for (int i = 0; i < K; i++) {
+    for (int i = 0; i < found; i++) {
         counts[data->labels[smallest[i].img_idx]]++;
     }
     
@@ -132,6 +3511,157 @@ int knn_predict(Dataset *data, Image *input, int K, double (*fptr)(Image *, Imag
     return max_label;
 }
 
+/**
+ * Given the input training dataset, an image to classify and K as well as a 
+ * distance metric,
+ *   (1) Find the K most similar images to `input` in the dataset
+ *   (2) Return the most frequent label of these K images.  If two are tied, 
+ *       output the smaller label.
+ */ 
+int knn_predict(Dataset *data, Image *input, int K, const Metric *metric) {
+    // With K < 1 there are no neighbors to vote, whatever the search
+    if (K < 1) {
+        return majority_label(data, NULL, 0);
+    }
+
+    // Array to keep track of K-closest images so far.
+    Knn_item *smallest = grow_scratch(NEIGHBORS_SCRATCH, sizeof(Knn_item) * K);
+    int found = find_neighbors(data, input, K, metric, smallest);
+
+    return majority_label(data, smallest, found);
+}
+
+/**
+ * knn_predict_batch classifies every image of `queries` and stores the
+ * labels in `predictions`, giving the same answers as calling knn_predict
+ * on each of them.
+ *
+ * For metrics whose keys follow from dot products (the euclidean and cosine
+ * distances) it computes a whole block of BATCH_QUERIES queries against a
+ * block of BATCH_TRAIN training images at a time, like a tiled matrix
+ * product. Each pair only needs the dot product a.b, since
+ * |a - b|^2 = |a|^2 + |b|^2 - 2 a.b and the norms are known. The
+ * dot products come 4x4 at a time from a register-tiled kernel, while the
+ * training block stays in cache for every query of the block, so the
+ * training set is streamed from memory once per block of queries instead of
+ * once per query. The results go straight into one heap per query. With
+ * sparse training images (see prepare_sparse), the block of queries is laid
+ * out pixel-major instead, and each training image multiplies only the rows
+ * of its nonzero pixels, for every query of the block at once.
+ *
+ * A training set with a pixel-major copy (see transpose_training) is
+ * searched one query at a time instead for metrics whose score uses the
+ * column kernels (see Metric.column_scores), since those also abandon
+ * blocks early, and so is one with a shortlist (see binarize_training and
+ * project_training) for every metric, or one ordered by norm (see order_training_by_norm) or with a
+ * vantage-point tree (see vp_tree_training) for metrics that can use them.
+ */
+void knn_predict_batch(Dataset *data, Dataset *queries, int K,
+                       const Metric *metric, int *predictions) {
+    if (K < 1 || metric->dot_key == NULL || uses_shortlist(data) || data->hnsw != NULL ||
+        data->ivf != NULL || (metric->column_scores && data->columns != NULL) ||
+        (metric->norm_bound != NULL && (data->by_norm != NULL || data->vp_tree != NULL))) {
+        for (int i = 0; i < queries->num_items; i++) {
+            Image query = dataset_image(queries, i);
+            predictions[i] = knn_predict(data, &query, K, metric);
+        }
+        return;
+    }
+    int n = data->num_pixels;
+    int wide_stride = ALIGN_UP(n, CACHE_LINE / sizeof(short));
+    int sparse = uses_sparse_block(data);
+
+    // Queries widened to 16 bits in the training pixel order, one per row,
+    // or one per column for sparse images. Queries past the last one of a
+    // block stay zero and are never reported. Pixels the training set does
+    // not store only count towards the norms, as they add nothing to dot
+    // products.
+    short *wide;
+    if (posix_memalign((void **)&wide, CACHE_LINE,
+                       sizeof(short) * wide_stride * BATCH_QUERIES) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    Knn_item *items = malloc(sizeof(Knn_item) * K * BATCH_QUERIES);
+    if (items == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    Knn_heap heaps[BATCH_QUERIES];
+    unsigned int query_sq[BATCH_QUERIES];
+
+    for (int qb = 0; qb < queries->num_items; qb += BATCH_QUERIES) {
+        int nq = queries->num_items - qb < BATCH_QUERIES ? queries->num_items - qb : BATCH_QUERIES;
+        memset(wide, 0, sizeof(short) * wide_stride * BATCH_QUERIES);
+        for (int i = 0; i < nq; i++) {
+            Image query = dataset_image(queries, qb + i);
+            short *row = wide + i * wide_stride;
+            query_sq[i] = 0;
+            for (int p = 0; p < data->sx * data->sy; p++) {
+                short pixel = query.data[data->pixel_order != NULL ? data->pixel_order[p] : p];
+                query_sq[i] += pixel * pixel;
+                if (p >= n) {
+                    continue;
+                }
+                if (sparse) {
+                    wide[p * BATCH_QUERIES + i] = pixel;
+                } else {
+                    row[p] = pixel;
+                }
+            }
+            heap_init(&heaps[i], items + i * K, K);
+        }
+
+        if (sparse) {
+            for (int t = 0; t < data->num_items; t++) {
+                size_t start = data->sparse_start[t];
+                unsigned int dots[BATCH_QUERIES];
+                data->kernels->dot_sparse_block(data->sparse_index + start,
+                                                data->sparse_values + start,
+                                                data->sparse_start[t + 1] - start, wide, dots);
+                for (int i = 0; i < nq; i++) {
+                    heap_offer(&heaps[i], metric->dot_key(data, t, query_sq[i], dots[i]), t);
+                }
+            }
+        } else {
+            for (int tb = 0; tb < data->num_items; tb += BATCH_TRAIN) {
+                int t_end = data->num_items - tb < BATCH_TRAIN ? data->num_items : tb + BATCH_TRAIN;
+                for (int qi = 0; qi < nq; qi += 4) {
+                    const short *q[4];
+                    for (int i = 0; i < 4; i++) {
+                        q[i] = wide + (qi + i) * wide_stride;
+                    }
+                    for (int tj = tb; tj < t_end; tj += 4) {
+                        // Past the end of the block, repeat the last image
+                        const unsigned char *t[4];
+                        for (int j = 0; j < 4; j++) {
+                            int idx = tj + j < t_end ? tj + j : t_end - 1;
+                            t[j] = data->pixels + (size_t)idx * data->stride;
+                        }
+                        unsigned int dots[16];
+                        data->kernels->dot_4x4(q, t, n, dots);
+
+                        for (int i = 0; i < 4 && qi + i < nq; i++) {
+                            for (int j = 0; j < 4 && tj + j < t_end; j++) {
+                                int idx = tj + j;
+                                double key = metric->dot_key(data, idx, query_sq[qi + i],
+                                                             dots[4 * i + j]);
+                                heap_offer(&heaps[qi + i], key, idx);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < nq; i++) {
+            predictions[qb + i] = majority_label(data, heaps[i].items, heaps[i].size);
+        }
+    }
+    free(wide);
+    free(items);
+}
+
 /** 
  * Free all the allocated memory for the dataset
  * Check to ensure that the function works properly when `data' is allocated
@@ -141,32 +3671,47 @@ void free_dataset(Dataset *data) {
     if (data == NULL) {
         return;
     }
-
-    for (int i = 0; i < data->num_items; i++) {
-        free(data->images[i].data);
+    release(data, data->pixel_order);
+    free(data->columns);
+    free(data->bits);
+    release(data, data->block_sums);
+    free_projection(data, data->projection);
+    release(data, data->projected);
+    free(data->norm_order);
+    free_dataset(data->by_norm);
+    release(data, data->pivots);
+    release(data, data->pivot_dists);
+    free_vp_tree(data, data->vp_tree);
+    free_hnsw(data, data->hnsw);
+    free_ivf(data, data->ivf);
+    release(data, data->sparse_start);
+    release(data, data->sparse_index);
+    release(data, data->sparse_values);
+    // The struct lives inside the mapping it describes
+    if (munmap(data->map, data->map_len) == -1) {
+        perror("munmap");
+        exit(1);
     }
-    free(data->images);
-    free(data->labels);
-    free(data);
 }
 
 
 /**
  * child_handler will be called by each child process, and is where the 
- * kNN predictions happen. Along with the training and testing datasets, the
- * function also takes in 
+ * kNN predictions happen. Along with the training dataset and the name of
+ * the testing dataset file, the function also takes in 
  *    (1) File descriptor for a pipe with input coming from the parent: p_in
  *    (2) File descriptor for a pipe with output going to the parent:  p_out
  * 
  * Once this function is called, the child should do the following:
  *    - Read an integer `start_idx` from the parent (through p_in)
  *    - Read an integer `N` from the parent (through p_in)
- *    - Call `knn_predict()` on testing images `start_idx` to `start_idx+N-1`
+ *    - Map only testing images `start_idx` to `start_idx+N-1` and classify
+ *        them with `knn_predict_batch()`
  *    - Write an integer representing the number of correct predictions to
  *        the parent (through p_out)
  */
-void child_handler(Dataset *training, Dataset *testing, int K, 
-                   double (*fptr)(Image *, Image *),int p_in, int p_out) {
+void child_handler(Dataset *training, const char *testing_file, int K, 
+                   const Metric *metric, int p_in, int p_out) {
 
     //TODO
     int start_idx;
@@ -180,21 +3725,39 @@ void child_handler(Dataset *training, Dataset *testing, int K,
         exit(1);
     }
 
-    int correct = 0;
+    Dataset *testing = map_dataset_slice(testing_file, start_idx, N);
+    if (testing == NULL) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", testing_file);
+        exit(1);
+    }
+    if (testing->sx != training->sx || testing->sy != training->sy) {
+        fprintf(stderr, "Error: %s has %dx%d images, but the training images are %dx%d\n",
+                testing_file, testing->sx, testing->sy, training->sx, training->sy);
+        exit(1);
+    }
 
-    for (int i=start_idx; i < start_idx + N && i < testing->num_items; i++) {
-        Image *to_check = &(testing->images[i]);
-        int prediction = knn_predict(training, to_check, K, fptr);
+    int *predictions = malloc(sizeof(int) * testing->num_items);
+    if (predictions == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    knn_predict_batch(training, testing, K, metric, predictions);
+
+    int correct = 0;
 
-        if (prediction == testing->labels[i]) {
+    for (int i = 0; i < testing->num_items; i++) {
+        if (predictions[i] == testing->labels[i]) {
             correct += 1;
         }
     }
+    free(predictions);
     
     if (write(p_out, &correct, sizeof(int)) == -1) {
         perror("write in child");
         exit(1);
     };
+    free_dataset(testing);
+    free_knn_scratch();
 
     return;
 }
@@ -209,19 +3772,10 @@ void child_handler(Dataset *training, Dataset *testing, int K,
 */
 double distance_cosine(Image *a, Image *b){
 
-    //TODO
-    double prod_ab = 0;
-    double len_a = 0;
-    double len_b = 0;
-
-    for (int i = 0; i < NUM_PIXELS; i++) {
-        prod_ab += a->data[i] * b->data[i];
-        len_a += a->data[i] * a->data[i];
-        len_b += b->data[i] * b->data[i];
-    }
-
-    len_a = sqrt(len_a);
-    len_b = sqrt(len_b);
+    int n = a->sx * a->sy;
+    double prod_ab = kernels.dot(a->data, b->data, n);
+    double len_a = sqrt(kernels.dot(a->data, a->data, n));
+    double len_b = sqrt(kernels.dot(b->data, b->data, n));
 
     double to_return = 2 * acos(prod_ab / (len_a * len_b)) / M_PI;
 
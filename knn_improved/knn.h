@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 /**
  * You will not be submitting this file, so do not change anything here
  * as it will not be reflected when the autotester is run. If you need any
@@ -18,18 +20,138 @@ typedef struct {
 } Image;
 
 /* This struct stores the images / labels in the dataset */
-typedef struct {
+typedef struct Dataset {
     int num_items;          // Number of images in the dataset
-    Image *images;          // List of `num_items` Image structs
+    int sx;                 // x resolution of every image
+    int sy;                 // y resolution of every image
+    int num_pixels;         // Pixels stored per image: sx * sy, or fewer once
+                            // prepare_training drops blank ones
+    int stride;             // Bytes from the start of one image to the next
+    unsigned char *pixels;  // Image i is `num_pixels` bytes at pixels + i * stride
     unsigned char *labels;  // List of `num_items` labels [0-9]
+    double *norms;          // Euclidean norm of each image, set at load time
+    unsigned int *sq_norms; // Squared euclidean norm of each image
+    int *pixel_order;       // Raster position of each stored pixel, or NULL
+                            // if pixels are stored in raster order
+    unsigned char *columns; // Pixel-major copy of the pixels, or NULL
+    const struct Kernels *kernels; // Kernels picked for this image size
+    unsigned long long *bits; // 1-bit copy of every image, or NULL
+    int bits_stride;        // 64-bit words from one image's bits to the next
+    int shortlist;          // Shortlist length as a multiple of K
+    struct Projection *projection; // PCA fitted to the images, or NULL
+    struct Dataset *by_norm; // Copy of the images sorted by norm, or NULL
+    int num_pivots;         // Pivots of the pivot table, or 0
+    int *pivots;            // Index of each pivot image
+    float *pivot_dists;     // Euclidean distances of each image to the pivots,
+                            // `pivot_stride` floats per image
+    int pivot_stride;
+    struct Vp_tree *vp_tree; // Vantage-point tree over the images, or NULL
+    struct Hnsw *hnsw;      // Navigable graph over the images, or NULL
+    struct Ivf *ivf;        // Inverted file of the images, or NULL
+    int *norm_order;        // Index in this dataset of each image of `by_norm`
+    float *projected;       // `projection->dims` floats per image, or NULL
+    unsigned short *block_sums; // Sums of the 4x4 pixel blocks of each image,
+                            // or NULL (see prepare_training)
+    int sums_stride;        // Entries from one image's block sums to the next
+    size_t *sparse_start;   // The nonzero pixels of image i are entries
+                            // sparse_start[i] to sparse_start[i + 1] - 1 of
+                            // the lists below, or NULL (see prepare_training)
+    unsigned short *sparse_index; // Stored position of each nonzero pixel
+    unsigned char *sparse_values; // Value of each nonzero pixel
+    float density;          // Fraction of nonzero pixels, if they are listed
+    void *map;              // Mapping holding this struct and its data
+    size_t map_len;         // Length of `map` in bytes
 } Dataset;
 
+/* Return an Image view of the i-th image of `data` */
+static inline Image dataset_image(const Dataset *data, int i) {
+    Image img = {data->sx, data->sy, data->pixels + (size_t)i * data->stride};
+    return img;
+}
+
+/* One of the nearest neighbors of an image, as reported by knn_neighbors */
+typedef struct {
+    double dist;    // Distance to the image
+    int img_idx;    // Index of the neighbor in the dataset
+} Knn_item;
+
+/**
+ * A query as the metrics see it: its pixels in the training set's order, and
+ * what was precomputed from it to match the training set.
+ */
+typedef struct {
+    const unsigned char *pixels;       // Pixels in the training set's order
+    unsigned int sq_norm;              // Squared euclidean norm of the pixels
+    unsigned int dropped_sq;           // Sum of the squares and sum of the
+    unsigned int dropped_sum;          // pixels the training set does not store
+    const unsigned short *block_sums;  // Like Dataset.block_sums, or NULL
+    const float *pivot_dists;          // Like Dataset.pivot_dists, or NULL
+} Query;
+
+/**
+ * A distance metric. The search ranks training images by a key that orders
+ * them the same way as the distance but may be cheaper to compute, and only
+ * computes real distances for the neighbors it reports.
+ */
+typedef struct Metric {
+    const char *name;
+    // Distance between two images
+    double (*distance)(Image *a, Image *b);
+    // Optional precompute hook, run on a training set by prepare_training
+    // once its pixels are in their final layout
+    void (*prepare)(Dataset *training);
+    // Store in keys[0 .. end - start - 1] the rank keys of training images
+    // `start` to `end - 1` against `query`. Images keyed above `bound`
+    // cannot be neighbors, so any key above it may be stored instead of the
+    // exact one. INFINITY marks images that can never be neighbors.
+    void (*score)(const Dataset *data, const Query *query, int start, int end,
+                  double bound, double *keys);
+    // Optional: the key of training image i from its dot product with the
+    // query and the query's squared norm, which lets knn_predict_batch
+    // compute keys with matrix products
+    double (*dot_key)(const Dataset *data, int i, unsigned int query_sq, unsigned int dot);
+    // Optional: a lower bound on the key of any image whose euclidean norm
+    // differs from the query's by `gap`, which lets the search of a training
+    // set ordered by norm stop early (see order_training_by_norm)
+    double (*norm_bound)(double gap);
+    // 1 if score uses the column kernels on a training set with a
+    // pixel-major copy (see transpose_training), which knn_predict_batch
+    // then leaves to the per-query search
+    int column_scores;
+} Metric;
+
+extern const Metric metric_euclidean;
+extern const Metric metric_cosine;
+extern const Metric metric_manhattan;
+
 double distance_euclidean(Image *a, Image *b);
+unsigned int distance_euclidean_sq(Image *a, Image *b);
+unsigned int distance_euclidean_sq_bounded(Image *a, Image *b, unsigned int bound);
+double distance_manhattan(Image *a, Image *b);
 
 Dataset *load_dataset(const char *filename);
+Dataset *map_dataset(const char *filename);
+Dataset *map_dataset_slice(const char *filename, int start, int count);
+int dataset_size(const char *filename);
+void prepare_training(Dataset *data, const Metric *metric);
+void transpose_training(Dataset *data);
+void binarize_training(Dataset *data, int multiplier);
+void project_training(Dataset *data, int components, int multiplier, const char *cache_file);
+void order_training_by_norm(Dataset *data);
+void pivot_training(Dataset *data, int num_pivots);
+void vp_tree_training(Dataset *data, const char *cache_file);
+int vp_tree_mismatches(Dataset *data, Dataset *queries, int K, const Metric *metric);
+void hnsw_training(Dataset *data, int M, int ef, const char *cache_file);
+void ivf_training(Dataset *data, int num_cells, int nprobe, int multiplier);
+size_t ivf_code_bytes(const Dataset *data);
+unsigned long long dataset_hash(const char *filename);
+void write_index(const Dataset *data, unsigned long long hash, const char *filename);
+Dataset *map_index(const char *filename);
 void free_dataset(Dataset *data);
 
 // New for A3!
 double distance_cosine(Image *a, Image *b);
-int knn_predict(Dataset *data, Image *img, int K, double (*fptr)(Image *,Image *));
-void child_handler(Dataset *training, Dataset *testing, int K, double (*fptr)(Image *, Image *),int p_in, int p_out);
+int knn_predict(Dataset *data, Image *img, int K, const Metric *metric);
+void knn_predict_batch(Dataset *data, Dataset *queries, int K, const Metric *metric, int *predictions);
+int knn_neighbors(Dataset *data, Image *img, int K, const Metric *metric, Knn_item *neighbors);
+void child_handler(Dataset *training, const char *testing_file, int K, const Metric *metric, int p_in, int p_out);
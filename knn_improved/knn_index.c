@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "knn.h"
+
+/**
+ * knn_index builds an index of a training set once, for every later run of
+ * the classifier to map in place of the training file. It takes the
+ * following command line arguments.
+ *   -P <num>: Also keep the distances of every image to <num> pivots, as
+ *        the classifier's -P does
+ *   -H <M>: Also keep a navigable small world graph, as the classifier's
+ *        -H does. The classifier then searches it without being asked to
+ *   -e <ef>: Images the graph search keeps by default (default is DEFAULT_EF)
+ *   -V : Also keep a vantage-point tree, as the classifier's -V does
+ *   -c <num>: Also keep a projection onto <num> principal components, as
+ *        the classifier's -c does. The classifier then shortlists with it
+ *        without being asked to
+ *   -I <cells>: Also keep an inverted file of <cells> cells, as the
+ *        classifier's -I does, also searched without being asked to. Only
+ *        one of -c and -I may be given
+ *   -N <nprobe>: Cells the inverted file search probes by default (default
+ *        is DEFAULT_NPROBE)
+ *   -m <mult>: Shortlist length of -c or -I by default, as a multiple of K,
+ *        at least 1 (default is DEFAULT_SHORTLIST)
+ *   -v : Print what is being built
+ *   training_data: A binary file containing training image / label data
+ *   index_file: The index file to write
+ *
+ * The index holds the training images as prepare_training leaves them, with
+ * what the precompute hooks of every metric add, so the classifier starts
+ * answering queries without preprocessing them (see write_index).
+ */
+/* Images the graph search keeps when -e is not given */
+#define DEFAULT_EF 64
+
+/* Shortlist multiplier of -c and -I when -m is not given */
+#define DEFAULT_SHORTLIST 10
+
+/* Cells the inverted file search probes when -N is not given */
+#define DEFAULT_NPROBE 8
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s -v -P <num> -H <M> -e <ef> -V -c <num> -I <cells> -N <nprobe> "
+            "-m <mult> training_data index_file\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    int verbose = 0;       // if verbose is 1, print extra debugging statements
+    int pivots = 0;        // Pivots of the pivot table, 0 for none
+    int graph_links = 0;   // M of the navigable graph, 0 for none
+    int ef = DEFAULT_EF;   // Images the graph search keeps
+    int vp_tree = 0;       // if vp_tree is 1, keep a vantage-point tree
+    int components = 0;    // PCA components, 0 for no projection
+    int cells = 0;         // Cells of the inverted file, 0 for none
+    int nprobe = DEFAULT_NPROBE; // Cells the inverted file search probes
+    int shortlist = DEFAULT_SHORTLIST; // Shortlist of -c and -I, as a multiple of K
+
+    while((opt = getopt(argc, argv, "vP:H:e:Vc:I:N:m:")) != -1) {
+        switch(opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'P':
+            pivots = atoi(optarg);
+            break;
+        case 'H':
+            graph_links = atoi(optarg);
+            break;
+        case 'e':
+            ef = atoi(optarg);
+            break;
+        case 'V':
+            vp_tree = 1;
+            break;
+        case 'c':
+            components = atoi(optarg);
+            break;
+        case 'I':
+            cells = atoi(optarg);
+            break;
+        case 'N':
+            nprobe = atoi(optarg);
+            break;
+        case 'm':
+            shortlist = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if(optind + 2 != argc || (components > 0 && cells > 0) || shortlist < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+    char *training_file = argv[optind];
+    char *index_file = argv[optind + 1];
+
+    Dataset *training = load_dataset(training_file);
+    if ( training == NULL ) {
+        fprintf(stderr, "The data set in %s could not be loaded\n", training_file);
+        exit(1);
+    }
+    unsigned long long hash = dataset_hash(training_file);
+    if (verbose) {
+        fprintf(stderr, "- Indexing %d %dx%d images of %s (hash %016llx)\n",
+                training->num_items, training->sx, training->sy, training_file, hash);
+    }
+    // The euclidean hook adds both the block sums and the nonzero pixel
+    // lists, which covers what the other metrics' hooks add
+    prepare_training(training, &metric_euclidean);
+    if (pivots > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Measuring distances to %d pivots\n", pivots);
+        }
+        pivot_training(training, pivots);
+    }
+    if (graph_links > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Building a graph with M = %d\n", graph_links);
+        }
+        hnsw_training(training, graph_links, ef, NULL);
+    }
+    if (vp_tree) {
+        if (verbose) {
+            fprintf(stderr, "- Building a vantage-point tree\n");
+        }
+        vp_tree_training(training, NULL);
+    }
+    if (components > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Projecting onto %d principal components\n", components);
+        }
+        project_training(training, components, shortlist, NULL);
+    }
+    if (cells > 0) {
+        if (verbose) {
+            fprintf(stderr, "- Splitting the images into %d cells\n", cells);
+        }
+        ivf_training(training, cells, nprobe, shortlist);
+    }
+    write_index(training, hash, index_file);
+    if (verbose) {
+        fprintf(stderr, "- Wrote %s\n", index_file);
+    }
+    free_dataset(training);
+    return 0;
+}
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "kernels.h"
+
+/**
+ * test_distance checks the kernel set picked at startup against plain
+ * loops that define what every kernel computes, which is what the scalar
+ * set does. Run it once per instruction set, e.g.
+ *
+ *     KNN_KERNELS=avx2 ./test_distance
+ *
+ * (`make test` runs every set). The pixel kernels are checked for every
+ * length up to TAIL_LENGTHS and some longer ones, so every vector tail is
+ * covered, and the specialized kernels at their own image size. All inputs
+ * come from a fixed pseudo-random sequence, and every result must match
+ * exactly: the float kernels get small integer values, whose sums are
+ * exact in any order.
+ *
+ * It prints the checks that fail, and exits with 1 if any did.
+ */
+
+/* Every length up to this one is checked, then the ones in `long_lengths` */
+#define TAIL_LENGTHS 160
+
+/* Longest input: the largest specialized image size */
+#define MAX_PIXELS 9216
+
+/* Random inputs per length */
+#define ROUNDS 4
+
+/* PQ subspaces checked, a multiple of 4 whose sums of 255s fit in 16 bits */
+#define PQ_SUBSPACES 64
+
+static const int long_lengths[] = {255, 256, 257, 511, 784, 1000, 1024, 4096, 9216};
+#define NUM_LONG_LENGTHS (int)(sizeof(long_lengths) / sizeof(long_lengths[0]))
+
+static unsigned int seed = 1;
+static int checks = 0;
+static int failures = 0;
+
+/* Next value of a fixed pseudo-random sequence, 0 to 32767 */
+static int next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/**
+ * Fill `len` pixels with a random pattern: in round 0 uniform noise, in
+ * round 1 mostly blank pixels, in round 2 only 0s and 255s, which gives the
+ * largest sums, and otherwise noise again
+ */
+static void fill_pixels(unsigned char *pixels, int len, int round) {
+    for (int i = 0; i < len; i++) {
+        int r = next_random();
+        if (round == 1) {
+            pixels[i] = r % 4 == 0 ? r >> 7 : 0;
+        } else if (round == 2) {
+            pixels[i] = r & 1 ? 255 : 0;
+        } else {
+            pixels[i] = r;
+        }
+    }
+}
+
+/* Count one check of `kernel` on `n` entries, and report it if it failed */
+static void check(int ok, const char *kernel, int n) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s kernels: %s is wrong for n = %d\n", kernels.name, kernel, n);
+    }
+}
+
+/*
+ * A bounded kernel must return the exact sum when it is at most the bound,
+ * and otherwise a partial sum above the bound
+ */
+static int bounded_ok(unsigned int got, unsigned int exact, unsigned int bound) {
+    return exact <= bound ? got == exact : got > bound && got <= exact;
+}
+
+static unsigned int ref_sq_diff(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return d;
+}
+
+static unsigned int ref_sad(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += abs(a[i] - b[i]);
+    }
+    return d;
+}
+
+static unsigned int ref_dot(const unsigned char *a, const unsigned char *b, int n) {
+    unsigned int d = 0;
+    for (int i = 0; i < n; i++) {
+        d += a[i] * b[i];
+    }
+    return d;
+}
+
+/**
+ * Check the kernels that come specialized by image size, from the set `k`,
+ * on `n` pixels. Pixels past `n` in the inputs are random, so kernels that
+ * read them show up, except where the layout guarantees zero padding.
+ */
+static void test_sized_kernels(const Kernels *k, int n, int round) {
+    static unsigned char a[MAX_PIXELS + 64], b[MAX_PIXELS + 64];
+    static unsigned char t[4][MAX_PIXELS + 64];
+    static short q[4][MAX_PIXELS + 64];
+    static unsigned char block[MAX_PIXELS * COLUMN_BLOCK] __attribute__((aligned(64)));
+    static unsigned long long bits_a[MAX_PIXELS / 64 + 1], bits_b[MAX_PIXELS / 64 + 1];
+    fill_pixels(a, sizeof(a), round);
+    fill_pixels(b, sizeof(b), round);
+
+    unsigned int sq = ref_sq_diff(a, b, n), sad = ref_sad(a, b, n);
+    check(k->sq_diff(a, b, n) == sq, "sq_diff", n);
+    check(k->sad(a, b, n) == sad, "sad", n);
+    check(k->dot(a, b, n) == ref_dot(a, b, n), "dot", n);
+    unsigned int bounds[] = {0, sq / 3, sq > 0 ? sq - 1 : 0, sq, UINT_MAX};
+    for (int i = 0; i < 5; i++) {
+        check(bounded_ok(k->sq_diff_bounded(a, b, n, bounds[i]), sq, bounds[i]),
+              "sq_diff_bounded", n);
+    }
+    unsigned int sad_bounds[] = {0, sad / 3, sad > 0 ? sad - 1 : 0, sad, UINT_MAX};
+    for (int i = 0; i < 5; i++) {
+        check(bounded_ok(k->sad_bounded(a, b, n, sad_bounds[i]), sad, sad_bounds[i]),
+              "sad_bounded", n);
+    }
+
+    // Queries widened to 16 bits are zero padded to a multiple of 32 pixels
+    const short *qs[4];
+    const unsigned char *ts[4];
+    for (int i = 0; i < 4; i++) {
+        fill_pixels(t[i], sizeof(t[i]), round);
+        fill_pixels(a, n, round);
+        memset(q[i], 0, sizeof(q[i]));
+        for (int p = 0; p < n; p++) {
+            q[i][p] = a[p];
+        }
+        qs[i] = q[i];
+        ts[i] = t[i];
+    }
+    unsigned int tile[16];
+    k->dot_4x4(qs, ts, n, tile);
+    int ok = 1;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            unsigned int d = 0;
+            for (int p = 0; p < n; p++) {
+                d += q[i][p] * t[j][p];
+            }
+            ok = ok && tile[4 * i + j] == d;
+        }
+    }
+    check(ok, "dot_4x4", n);
+
+    // Row p of the block holds pixel p of its COLUMN_BLOCK images
+    fill_pixels(block, (size_t)n * COLUMN_BLOCK, round);
+    fill_pixels(a, n, round);
+    unsigned int exact[COLUMN_BLOCK], least = UINT_MAX;
+    for (int j = 0; j < COLUMN_BLOCK; j++) {
+        exact[j] = 0;
+        for (int p = 0; p < n; p++) {
+            int diff = block[(size_t)p * COLUMN_BLOCK + j] - a[p];
+            exact[j] += diff * diff;
+        }
+        least = exact[j] < least ? exact[j] : least;
+    }
+    unsigned int column_bounds[] = {0, least / 2, least, UINT_MAX};
+    for (int i = 0; i < 4; i++) {
+        unsigned int out[COLUMN_BLOCK];
+        k->sq_diff_columns(block, a, n, column_bounds[i], out);
+        ok = 1;
+        for (int j = 0; j < COLUMN_BLOCK; j++) {
+            // Stopping early leaves every partial sum above the bound
+            ok = ok && (out[j] == exact[j] ||
+                        (out[j] > column_bounds[i] && out[j] <= exact[j]));
+        }
+        check(ok, "sq_diff_columns", n);
+    }
+
+    // Bit arrays are zero padded to whole words
+    int words = (n + 63) / 64;
+    unsigned int differing = 0;
+    memset(bits_a, 0, sizeof(bits_a));
+    memset(bits_b, 0, sizeof(bits_b));
+    for (int p = 0; p < n; p++) {
+        int x = next_random() & 1, y = next_random() & 1;
+        bits_a[p / 64] |= (unsigned long long)x << (p % 64);
+        bits_b[p / 64] |= (unsigned long long)y << (p % 64);
+        differing += x != y;
+    }
+    check(words > 0 && k->hamming(bits_a, bits_b, n) == differing, "hamming", n);
+}
+
+/* Check the kernels of `kernels` that are not specialized by size on `n` entries */
+static void test_unsized_kernels(int n, int round) {
+    static unsigned short sums_a[MAX_PIXELS + 32], sums_b[MAX_PIXELS + 32];
+    static float floats_a[MAX_PIXELS + 16], floats_b[MAX_PIXELS + 16];
+    static unsigned char dense[MAX_PIXELS + 3], values[MAX_PIXELS];
+    static unsigned short index[MAX_PIXELS];
+    static short rows[MAX_PIXELS * SPARSE_QUERIES] __attribute__((aligned(32)));
+
+    // Block sums are below 4096 and zero padded to a multiple of 32 entries
+    int padded = (n + 31) / 32 * 32;
+    memset(sums_a, 0, sizeof(sums_a));
+    memset(sums_b, 0, sizeof(sums_b));
+    unsigned long long sq = 0;
+    unsigned int sad = 0;
+    for (int i = 0; i < n; i++) {
+        sums_a[i] = round == 2 ? (next_random() & 1) * 4095 : next_random() % 4096;
+        sums_b[i] = round == 2 ? (next_random() & 1) * 4095 : next_random() % 4096;
+        int diff = sums_a[i] - sums_b[i];
+        sq += (long long)diff * diff;
+        sad += abs(diff);
+    }
+    check(kernels.sq_diff_u16(sums_a, sums_b, padded) == sq, "sq_diff_u16", n);
+    check(kernels.sad_u16(sums_a, sums_b, padded) == sad, "sad_u16", n);
+
+    // Floats are zero padded to a multiple of 16; small integers sum exactly
+    padded = (n + 15) / 16 * 16;
+    memset(floats_a, 0, sizeof(floats_a));
+    memset(floats_b, 0, sizeof(floats_b));
+    float sq_f = 0, max_f = 0;
+    for (int i = 0; i < n; i++) {
+        floats_a[i] = next_random() % 64 - 32;
+        floats_b[i] = next_random() % 64 - 32;
+        float diff = floats_a[i] - floats_b[i];
+        sq_f += diff * diff;
+        max_f = abs((int)diff) > max_f ? abs((int)diff) : max_f;
+    }
+    check(kernels.sq_diff_f32(floats_a, floats_b, padded) == sq_f, "sq_diff_f32", n);
+    check(kernels.max_diff_f32(floats_a, floats_b, padded) == max_f, "max_diff_f32", n);
+
+    // The nonzero pixels of one image against a dense one, readable 3
+    // bytes past its end, and against a pixel-major block of queries
+    fill_pixels(dense, sizeof(dense), round);
+    for (int p = 0; p < n * SPARSE_QUERIES; p++) {
+        rows[p] = next_random() & 0xff;
+    }
+    int nnz = 0;
+    unsigned int dot = 0, block_dots[SPARSE_QUERIES] = {0};
+    for (int p = 0; p < n; p++) {
+        int r = next_random();
+        if (round == 1 ? r % 4 == 0 : r % 2 == 0) {
+            index[nnz] = p;
+            values[nnz] = r >> 7;
+            dot += values[nnz] * dense[p];
+            for (int j = 0; j < SPARSE_QUERIES; j++) {
+                block_dots[j] += values[nnz] * rows[p * SPARSE_QUERIES + j];
+            }
+            nnz++;
+        }
+    }
+    check(kernels.dot_sparse(index, values, nnz, dense) == dot, "dot_sparse", n);
+    unsigned int out[SPARSE_QUERIES];
+    kernels.dot_sparse_block(index, values, nnz, rows, out);
+    check(memcmp(out, block_dots, sizeof(out)) == 0, "dot_sparse_block", n);
+}
+
+/* Check pq_scan on `subspaces` subspaces of a block of PQ_BLOCK codes */
+static void test_pq_scan(int subspaces, int round) {
+    static unsigned char codes[PQ_SUBSPACES * 16], luts[PQ_SUBSPACES * 16];
+    fill_pixels(codes, subspaces * 16, 0);
+    fill_pixels(luts, subspaces * 16, round);
+    unsigned short exact[PQ_BLOCK] = {0}, out[PQ_BLOCK];
+    for (int s = 0; s < subspaces; s++) {
+        for (int j = 0; j < 16; j++) {
+            exact[j] += luts[16 * s + (codes[16 * s + j] & 0x0f)];
+            exact[j + 16] += luts[16 * s + (codes[16 * s + j] >> 4)];
+        }
+    }
+    kernels.pq_scan(codes, luts, subspaces, out);
+    check(memcmp(out, exact, sizeof(out)) == 0, "pq_scan", subspaces);
+}
+
+int main(void) {
+    const char *forced = getenv("KNN_KERNELS");
+    if (forced != NULL && strcmp(forced, kernels.name) != 0) {
+        printf("Skipping the %s kernels, which this CPU does not support\n", forced);
+        return 0;
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int n = 1; n <= TAIL_LENGTHS; n++) {
+            test_sized_kernels(&kernels, n, round);
+            test_unsized_kernels(n, round);
+        }
+        for (int i = 0; i < NUM_LONG_LENGTHS; i++) {
+            test_sized_kernels(&kernels, long_lengths[i], round);
+            test_unsized_kernels(long_lengths[i], round);
+        }
+        // Each specialized set at the one size it is built for
+        for (int i = 0; i < NUM_LONG_LENGTHS; i++) {
+            const Kernels *k = kernels_for_size(long_lengths[i]);
+            if (k != &kernels) {
+                test_sized_kernels(k, long_lengths[i], round);
+            }
+        }
+        for (int subspaces = 4; subspaces <= PQ_SUBSPACES; subspaces += 4) {
+            test_pq_scan(subspaces, round);
+        }
+    }
+    printf("%s kernels: %d of %d checks passed\n", kernels.name, checks - failures, checks);
+    return failures > 0;
+}
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "knn.h"
+#include "kernels.h"
+
+/**
+ * test_knn checks that the exact search modes find the same neighbors as a
+ * plain scan. A fixed pseudo-random training set and query set are written
+ * to temporary files, and for every metric with a norm bound each mode
+ * below is set up on its own copy of the training set:
+ *
+ *   - prepare_training alone, which reorders and drops pixels and adds the
+ *     block sums that prune the scan (and the nonzero pixel lists)
+ *   - order_training_by_norm, as the classifier's -n does
+ *   - pivot_training, as the classifier's -P does
+ *   - vp_tree_training, as the classifier's -V does
+ *   - transpose_training, as the classifier's -t does
+ *
+ * knn_neighbors must then report the same images at the same distances as
+ * on the training set as loaded, for several K. Images come in a size with
+ * specialized kernels, one without, and one the block sums do not apply
+ * to. K = 0 and negative K must find no neighbors and still predict a
+ * label.
+ *
+ * It prints the checks that fail, and exits with 1 if any did.
+ */
+
+/* Images of the training set and of the query set */
+#define TRAIN_ITEMS 700
+#define QUERY_ITEMS 40
+
+/* Blank rows and columns around every image, which prepare_training drops */
+#define BORDER 3
+
+/* Images in the training set that are copies of another one, as ties */
+#define COPIES 20
+
+/* Patterns the images are drawn from, at most 32x32 */
+#define PROTOTYPES 40
+
+/* Pivots of the pivot table */
+#define PIVOTS 8
+
+static const int sizes[][2] = {{28, 28}, {32, 24}, {30, 30}};
+#define NUM_SIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+static const int k_values[] = {1, 2, 5, 20, TRAIN_ITEMS, TRAIN_ITEMS + 5};
+#define NUM_K_VALUES (int)(sizeof(k_values) / sizeof(k_values[0]))
+
+static const Metric *metrics[] = {&metric_euclidean, &metric_manhattan};
+#define NUM_METRICS (int)(sizeof(metrics) / sizeof(metrics[0]))
+
+enum { PREPARED, BY_NORM, PIVOTED, VP_TREE, TRANSPOSED, NUM_MODES };
+static const char *mode_names[NUM_MODES] = {
+    "prepare_training", "order_training_by_norm", "pivot_training", "vp_tree_training",
+    "transpose_training"
+};
+
+static unsigned int seed = 1;
+static int checks = 0;
+static int failures = 0;
+
+/* Next value of a fixed pseudo-random sequence, 0 to 32767 */
+static int next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+/* Count one check, and report it with `what` if it failed */
+static void check(int ok, const char *what, int sx, int sy, const char *metric, int K) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%dx%d images, %s distance, K = %d: %s is wrong\n", sx, sy, metric,
+                K, what);
+    }
+}
+
+/*
+ * Write `num_items` random sx x sy images to a new temporary file and
+ * return its name, which the caller frees. Each image is one of PROTOTYPES
+ * fixed patterns, dimmed by a random amount and with some pixels changed,
+ * so images have close neighbors whose distance is not much more than the
+ * difference of their norms, which is where the searches prune the most.
+ * Images are blank within BORDER of their edges, and the last `copies`
+ * repeat earlier images.
+ */
+static char *write_dataset(int sx, int sy, int num_items, int copies) {
+    static unsigned char prototypes[PROTOTYPES][32 * 32];
+    static int made = 0;
+    if (!made) {
+        for (int t = 0; t < PROTOTYPES; t++) {
+            // From almost blank to almost full
+            int density = 1 + t % 8;
+            for (int p = 0; p < 32 * 32; p++) {
+                int r = next_random();
+                prototypes[t][p] = r % 8 < density ? r >> 7 : 0;
+            }
+        }
+        made = 1;
+    }
+
+    char *name = strdup("/tmp/test_knn.XXXXXX");
+    int fd = name != NULL ? mkstemp(name) : -1;
+    FILE *file = fd != -1 ? fdopen(fd, "wb") : NULL;
+    if (file == NULL) {
+        perror("mkstemp");
+        exit(1);
+    }
+    int header[4] = {0, sx, sy, num_items};
+    memcpy(header, "KNNG", 4);
+    fwrite(header, sizeof(int), 4, file);
+    unsigned char *records = malloc((size_t)num_items * (1 + sx * sy));
+    if (records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_items; i++) {
+        unsigned char *record = records + (size_t)i * (1 + sx * sy);
+        if (i >= num_items - copies) {
+            memcpy(record, records + (size_t)(next_random() % (num_items - copies)) *
+                           (1 + sx * sy), 1 + sx * sy);
+            continue;
+        }
+        int t = next_random() % PROTOTYPES;
+        int scale = 32 + next_random() % 97;
+        record[0] = t % 10;
+        for (int y = 0; y < sy; y++) {
+            for (int x = 0; x < sx; x++) {
+                int r = next_random();
+                int inside = x >= BORDER && x < sx - BORDER && y >= BORDER && y < sy - BORDER;
+                int pixel = prototypes[t][y * 32 + x] * scale / 128 + (r % 16 == 0 ? r % 9 : 0);
+                record[1 + y * sx + x] = inside ? (pixel < 255 ? pixel : 255) : 0;
+            }
+        }
+    }
+    fwrite(records, 1 + sx * sy, num_items, file);
+    free(records);
+    if (fclose(file) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    return name;
+}
+
+/* Load `filename` and set it up for searches in `mode` under `metric` */
+static Dataset *load_mode(const char *filename, int mode, const Metric *metric) {
+    Dataset *data = load_dataset(filename);
+    if (data == NULL) {
+        fprintf(stderr, "Error: could not load %s\n", filename);
+        exit(1);
+    }
+    prepare_training(data, metric);
+    if (mode == BY_NORM) {
+        order_training_by_norm(data);
+    } else if (mode == PIVOTED) {
+        pivot_training(data, PIVOTS);
+    } else if (mode == VP_TREE) {
+        vp_tree_training(data, NULL);
+    } else if (mode == TRANSPOSED) {
+        transpose_training(data);
+    }
+    return data;
+}
+
+/*
+ * Check every mode against a plain scan of the training set as loaded, on
+ * every query of `queries`
+ */
+static void test_modes(const char *train_file, Dataset *queries, const Metric *metric) {
+    Dataset *plain = load_dataset(train_file);
+    Knn_item *expected = malloc(sizeof(Knn_item) * (TRAIN_ITEMS + 5));
+    Knn_item *found = malloc(sizeof(Knn_item) * (TRAIN_ITEMS + 5));
+    if (plain == NULL || expected == NULL || found == NULL) {
+        fprintf(stderr, "Error: could not load %s\n", train_file);
+        exit(1);
+    }
+    for (int mode = 0; mode < NUM_MODES; mode++) {
+        Dataset *data = load_mode(train_file, mode, metric);
+        for (int k = 0; k < NUM_K_VALUES; k++) {
+            int K = k_values[k];
+            int ok = 1;
+            for (int q = 0; q < queries->num_items; q++) {
+                Image query = dataset_image(queries, q);
+                int count = knn_neighbors(plain, &query, K, metric, expected);
+                ok = ok && count == (K < plain->num_items ? K : plain->num_items);
+                ok = ok && knn_neighbors(data, &query, K, metric, found) == count;
+                for (int i = 0; ok && i < count; i++) {
+                    ok = found[i].img_idx == expected[i].img_idx &&
+                         found[i].dist == expected[i].dist;
+                }
+            }
+            check(ok, mode_names[mode], data->sx, data->sy, metric->name, K);
+        }
+
+        // No neighbors for K < 1, though a label is still predicted
+        int bad_k[] = {0, -1, -1000000};
+        for (int k = 0; k < 3; k++) {
+            int predictions[QUERY_ITEMS];
+            knn_predict_batch(data, queries, bad_k[k], metric, predictions);
+            int ok = 1;
+            for (int q = 0; q < queries->num_items; q++) {
+                Image query = dataset_image(queries, q);
+                int label = knn_predict(data, &query, bad_k[k], metric);
+                ok = ok && knn_neighbors(data, &query, bad_k[k], metric, found) == 0 &&
+                     label >= 0 && label <= 9 && predictions[q] == label;
+            }
+            check(ok, mode_names[mode], data->sx, data->sy, metric->name, bad_k[k]);
+        }
+        free_dataset(data);
+    }
+    free(expected);
+    free(found);
+    free_dataset(plain);
+}
+
+int main(void) {
+    const char *forced = getenv("KNN_KERNELS");
+    if (forced != NULL && strcmp(forced, kernels.name) != 0) {
+        printf("Skipping the searches with the %s kernels, which this CPU does not support\n",
+               forced);
+        return 0;
+    }
+    for (int s = 0; s < NUM_SIZES; s++) {
+        char *train_file = write_dataset(sizes[s][0], sizes[s][1], TRAIN_ITEMS, COPIES);
+        char *query_file = write_dataset(sizes[s][0], sizes[s][1], QUERY_ITEMS, 0);
+        Dataset *queries = load_dataset(query_file);
+        if (queries == NULL) {
+            fprintf(stderr, "Error: could not load %s\n", query_file);
+            exit(1);
+        }
+        for (int m = 0; m < NUM_METRICS; m++) {
+            test_modes(train_file, queries, metrics[m]);
+        }
+        free_dataset(queries);
+        unlink(train_file);
+        unlink(query_file);
+        free(train_file);
+        free(query_file);
+    }
+    printf("%s kernels: %d of %d search checks passed\n", kernels.name, checks - failures,
+           checks);
+    return failures > 0;
+}